@@ -21,12 +21,20 @@ static const char
     pkgname[]   = "darkhttpd/1.13.from.git",
     copyright[] = "copyright (c) 2003-2021 Emil Mikulic";
 
-/* Possible build options: -DDEBUG -DNO_IPV6 */
+/* Possible build options: -DDEBUG -DNO_IPV6 -DNO_EPOLL -DNO_IO_URING
+ *                         -DNO_THREADS -DNO_SIMD -DNO_INOTIFY
+ *                         -DWITH_ZLIB (needs -lz) -DWITH_BROTLI
+ *                         (needs -lbrotlienc) -DWITH_ZSTD (needs -lzstd)
+ */
 
 #ifndef NO_IPV6
 # define HAVE_INET6
 #endif
 
+#ifndef NO_THREADS
+# define HAVE_THREADS
+#endif
+
 #ifndef DEBUG
 # define NDEBUG
 static const int debug = 0;
@@ -38,16 +46,41 @@ static const int debug = 1;
 # define _GNU_SOURCE /* for strsignal() and vasprintf() */
 # define _FILE_OFFSET_BITS 64 /* stat() files bigger than 2GB */
 # include <sys/sendfile.h>
+# define HAVE_SPLICE
+# ifndef NO_EPOLL
+#  define HAVE_EPOLL
+#  include <sys/epoll.h>
+# endif
+# if !defined(NO_IO_URING) && defined(HAVE_EPOLL) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#   include <linux/io_uring.h>
+#   include <sys/syscall.h>
+#   include <poll.h>
+#   if defined(IORING_ACCEPT_MULTISHOT) && defined(__NR_io_uring_setup)
+#    define HAVE_IO_URING
+#   endif
+#  endif
+# endif
+# ifndef NO_INOTIFY
+#  define HAVE_INOTIFY
+#  include <sys/inotify.h>
+# endif
 #endif
 
 #ifdef __sun__
 # include <sys/sendfile.h>
 #endif
 
+#ifdef __APPLE__
+# define st_mtim st_mtimespec   /* only for the ETag's nanoseconds */
+#endif
+
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/param.h>
@@ -71,6 +104,42 @@ static const int debug = 1;
 #include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_THREADS
+# include <pthread.h>
+#endif
+
+/* --compress does its compressing on a thread of its own. */
+#if defined(HAVE_THREADS) && \
+    (defined(WITH_ZLIB) || defined(WITH_BROTLI) || defined(WITH_ZSTD))
+# define HAVE_COMPRESS
+# ifdef WITH_ZLIB
+#  include <zlib.h>
+# endif
+# ifdef WITH_BROTLI
+#  include <brotli/encode.h>
+# endif
+# ifdef WITH_ZSTD
+#  include <zstd.h>
+# endif
+#endif
+
+/* SSE2 is always there on x86-64; AVX2 is picked at runtime if the CPU has
+ * it.
+ */
+#if !defined(NO_SIMD) && defined(__SSE2__) && defined(__GNUC__)
+# define HAVE_SSE2
+# include <emmintrin.h>
+# if defined(__x86_64__) || defined(__i386__)
+#  define HAVE_AVX2
+#  include <immintrin.h>
+# endif
+#endif
+
+/* accept4() hands back a socket with its flags already set. */
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+# define HAVE_ACCEPT4
+#endif
+
 #if defined(__has_feature)
 # if __has_feature(memory_sanitizer)
 #  include <sanitizer/msan_interface.h>
@@ -112,6 +181,15 @@ static const int debug = 1;
 # define unused
 #endif
 
+/* State that belongs to one event loop.  With --threads, every thread runs
+ * its own loop and gets its own copy.
+ */
+#ifdef HAVE_THREADS
+# define per_loop __thread
+#else
+# define per_loop
+#endif
+
 /* [->] borrowed from FreeBSD's src/sys/sys/systm.h,v 1.276.2.7.4.1 */
 #ifndef CTASSERT                /* Allow lint to override */
 # define CTASSERT(x)             _CTASSERT(x, __LINE__)
@@ -194,6 +272,10 @@ struct {                                                                \
         (var) && ((tvar) = LIST_NEXT((var), field), 1);                 \
         (var) = (tvar))
 
+#define LIST_INIT(head) do {                                            \
+        LIST_FIRST((head)) = NULL;                                      \
+} while (0)
+
 #define LIST_INSERT_HEAD(head, elm, field) do {                         \
         if ((LIST_NEXT((elm), field) = LIST_FIRST((head))) != NULL)     \
                 LIST_FIRST((head))->field.le_prev = &LIST_NEXT((elm), field);\
@@ -211,11 +293,89 @@ struct {                                                                \
 } while (0)
 /* [<-] */
 
-static LIST_HEAD(conn_list_head, connection) connlist =
+static per_loop LIST_HEAD(conn_list_head, connection) connlist =
     LIST_HEAD_INITIALIZER(conn_list_head);
 
+/* To prevent a malformed request from eating up too much memory, die once the
+ * request exceeds this many bytes:
+ */
+#define MAX_REQUEST_LENGTH 4000
+
+/* Room for a response header without going to the arena. */
+#define HEADER_BUF_SIZE 512
+
+/* Files up to this size are read in and sent in one go with the header. */
+#define SMALL_FILE 16384
+
+/* The most offered to the socket in one send.  A socket that takes less than
+ * it's offered is full, so there's no need to try again until it says it's
+ * writable.
+ */
+#define SEND_CHUNK (1 << 20)
+
+/* A Range: field with more ranges than this is ignored, and the whole file
+ * sent instead.
+ */
+#define MAX_RANGES 16
+
+#ifndef MSG_MORE
+# define MSG_MORE 0
+#endif
+
+/* Bump allocator for the strings parsed out of a request.  The first block is
+ * part of the connection, so a typical request doesn't malloc() any; a big
+ * one chains more blocks on.  It's all let go at once when the request is
+ * done with.
+ */
+#define ARENA_SIZE 1024
+struct arena_block {
+    struct arena_block *next;
+    char data[];
+};
+struct arena {
+    char *pos, *end;            /* free space in the current block */
+    struct arena_block *extra;  /* chained blocks, newest first */
+    char first[ARENA_SIZE];
+};
+
+/* Request header fields we look at.  parse_request() finds them all in one
+ * pass, see parse_headers().
+ */
+enum {
+    FIELD_ACCEPT_ENCODING,
+    FIELD_AUTHORIZATION,
+    FIELD_CONNECTION,
+    FIELD_CONTENT_LENGTH,
+    FIELD_HOST,
+    FIELD_IF_MODIFIED_SINCE,
+    FIELD_IF_NONE_MATCH,
+    FIELD_IF_RANGE,
+    FIELD_RANGE,
+    FIELD_REFERER,
+    FIELD_TRANSFER_ENCODING,
+    FIELD_USER_AGENT,
+    NUM_FIELDS
+};
+
+/* One of the ranges in a Range: field.  Once it's been resolved against the
+ * file, part is where its part header is in a multipart/byteranges reply.
+ */
+struct byterange {
+    off_t from, to;     /* -1 if not given, before resolving */
+    size_t part;
+};
+
+/* Token bucket for rate limiting.  It fills at the rate, up to a second's
+ * worth.
+ */
+struct bucket {
+    off_t tokens;
+    uint64_t refill_ms; /* last filled, 0 = never, so it starts full */
+};
+
 struct connection {
     LIST_ENTRY(connection) entries;
+    int pooled;         /* has been used before, and put back in the pool */
 
     int socket;
 #ifdef HAVE_INET6
@@ -223,7 +383,35 @@ struct connection {
 #else
     in_addr_t client;
 #endif
-    time_t last_active;
+#ifdef HAVE_EPOLL
+    uint32_t events;    /* epoll interest currently registered, 0 = none */
+    LIST_ENTRY(connection) ready_entries;
+    int send_ready;     /* on the readylist */
+#endif
+#ifdef HAVE_IO_URING
+    int uring_inflight; /* SQEs submitted but not yet completed */
+    int uring_pollout;  /* wait for POLLOUT before the next splice */
+    off_t uring_charged;/* taken from the rate limit buckets for the send
+                         * or splice in that's in flight */
+#endif
+#ifdef HAVE_SPLICE
+    int pipe[2];        /* for splicing file -> pipe -> socket */
+    int pipe_size;
+    size_t pipe_pending;/* bytes sitting in the pipe */
+#endif
+    struct send_buf *send_buf; /* for SEND_PREAD, NULL if nothing unsent */
+    int send_fallback;  /* sendfile() or splice() failed on reply_fd */
+    LIST_ENTRY(connection) timer_entries;
+    enum {
+        TIMER_NONE,     /* not in the timer wheel */
+        TIMER_HEADER,   /* waiting for the rest of the request header */
+        TIMER_IDLE,     /* keep-alive, waiting for the next request */
+        TIMER_SEND,     /* waiting for the client to take more of the reply */
+        TIMER_SHAPE     /* parked until its rate limit lets it send more */
+    } timer;
+    uint64_t deadline;  /* monotonic ms */
+    uint64_t timer_tick;/* the tick it's filed under in the timer wheel */
+    uint64_t started_ms;/* when the request came in, for send_stats */
     enum {
         RECV_REQUEST,   /* receiving request */
         SEND_HEADER,    /* sending generated header */
@@ -231,25 +419,59 @@ struct connection {
         DONE            /* connection closed, need to remove from queue */
     } state;
 
-    /* char request[request_length+1] is null-terminated */
-    char *request;
-    size_t request_length;
+    /* Requests are received straight into here, and are null-terminated at
+     * request_length once the end of the header is found.  header_scan is
+     * how far we've looked for it.  Any pipelined requests that came in
+     * behind it are the next [pipelined] bytes, the first of which was
+     * overwritten by the null and saved in pipelined_first.
+     */
+    char request[MAX_REQUEST_LENGTH + 1];
+    size_t request_length, header_scan, pipelined;
+    char pipelined_first;
+
+    /* Where each known field's value is in request, start 0 = not given. */
+    struct {
+        unsigned short start, length;
+    } fields[NUM_FIELDS];
 
-    /* request fields */
+    /* request fields, allocated from the arena */
+    struct arena arena;
     char *method, *url, *referer, *user_agent, *authorization;
     off_t range_begin, range_end;
     off_t range_begin_given, range_end_given;
+    struct byterange ranges[MAX_RANGES + 1]; /* range_* is the first one */
+    size_t num_ranges;
 
+    /* The response header is built in header_buf, and moved to the arena if
+     * it doesn't fit.  header_size is how much room there is.
+     */
     char *header;
-    size_t header_length, header_sent;
+    size_t header_length, header_sent, header_size;
     int header_dont_free, header_only, http_code, conn_close;
+    char header_buf[HEADER_BUF_SIZE];
 
     enum { REPLY_GENERATED, REPLY_FROMFILE } reply_type;
     char *reply;
     int reply_dont_free;
+    struct file_cache_entry *cache_entry; /* that reply points into */
     int reply_fd;
     off_t reply_start, reply_length, reply_sent,
           total_sent; /* header + body = total, for logging */
+
+    /* For a multipart/byteranges reply, the part headers and closing
+     * boundary, which the file ranges go between: see reply_segment().
+     */
+    char *multipart;
+    size_t multipart_length;
+
+    /* Rate limiting: see shape_reply().  The bucket lasts as long as the
+     * connection, and rate can change from one request to the next.
+     */
+    int shaped;         /* this reply is rate limited */
+    const char *decoded_url; /* from process_get(), what rate_map matches */
+    off_t rate;         /* bytes per second, 0 = no limit of its own */
+    struct bucket bucket;
+    struct client_bucket *client_bucket; /* NULL if no --client-rate-limit */
 };
 
 struct forward_mapping {
@@ -268,21 +490,40 @@ static struct mime_mapping *mime_map = NULL;
 static size_t mime_map_size = 0;
 static size_t longest_ext = 0;
 
-/* If a connection is idle for timeout_secs or more, it gets closed and
- * removed from the connlist.
+/* If a keep-alive connection is idle for timeout_secs or more, it gets closed
+ * and removed from the connlist.  The header and send timeouts default to the
+ * same, so -1 means "use timeout_secs".
  */
 static int timeout_secs = 30;
+static int header_timeout_secs = -1;
+static int send_timeout_secs = -1;
 static char *keep_alive_field = NULL;
 
 /* Time is cached in the event loop to avoid making an excessive number of
- * gettimeofday() calls.
+ * gettimeofday() calls.  now is wall time for logs and headers, now_ms is
+ * monotonic, for deadlines.
  */
-static time_t now;
-
-/* To prevent a malformed request from eating up too much memory, die once the
- * request exceeds this many bytes:
+static per_loop time_t now;
+static per_loop uint64_t now_ms;
+
+/* Connection deadlines are kept in a hierarchical timer wheel, so the event
+ * loop only looks at connections whose time is up, and can sleep until the
+ * nearest deadline.  Each slot of a level spans one turn of the level below,
+ * and its connections are cascaded down when that turn starts.  A deadline
+ * that moves later (e.g. a send making progress) is left where it is, and
+ * re-filed when its slot comes up.
  */
-#define MAX_REQUEST_LENGTH 4000
+#define TIMER_TICK_MS 100
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4
+
+static per_loop struct {
+    LIST_HEAD(timer_slot, connection) slot[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t tick;      /* next tick to run */
+    unsigned int count; /* connections in the wheel */
+} wheel;
 
 /* Defaults can be overridden on the command-line */
 static const char *bindaddr;
@@ -291,7 +532,7 @@ static int max_connections = -1;    /* kern.ipc.somaxconn */
 static const char *index_name = "index.html";
 static int no_listing = 0;
 
-static int sockin = -1;             /* socket to accept connections from */
+static per_loop int sockin = -1;    /* socket to accept connections from */
 #ifdef HAVE_INET6
 static int inet6 = 0;               /* whether the socket uses inet6 */
 #endif
@@ -302,12 +543,144 @@ static char *pidfile_name = NULL;   /* NULL = no pidfile */
 static int want_chroot = 0, want_daemon = 0, want_accf = 0,
            want_keepalive = 1, want_server_id = 1;
 static char *server_hdr = NULL;
+static size_t server_hdr_len;
 static char *auth_key = NULL;
-static uint64_t num_requests = 0, total_in = 0, total_out = 0;
-static int accepting = 1;           /* set to 0 to stop accept()ing */
+static per_loop uint64_t num_requests = 0, total_in = 0, total_out = 0;
+static per_loop uint64_t num_accepts = 0, accept_wakeups = 0;
+static per_loop uint64_t conn_pool_hits = 0, conn_pool_allocs = 0;
+static per_loop uint64_t file_cache_hits = 0, file_cache_misses = 0,
+                         file_cache_evictions = 0;
+
+/* How long replies took, from the request coming in to the last byte going
+ * out, for small ones and for ones over SMALL_REPLY.  And how much went out
+ * in the iterations of the loop that sent anything: total_out over
+ * busy_iterations is the average.
+ */
+#define SMALL_REPLY (64 << 10)
+struct send_stats {
+    uint64_t replies[2], reply_ms[2], max_reply_ms[2];
+    uint64_t busy_iterations, max_iteration_out;
+};
+static per_loop struct send_stats send_stats;
+static int conn_prealloc = 64; /* connections to allocate up front */
+static per_loop int accepting = 1;  /* set to 0 to stop accept()ing */
+static int accept_burst = 64; /* max connections to accept per wakeup */
+
+/* A writable connection keeps sending until the socket would block, or until
+ * it has sent this many bytes, so that one big download doesn't starve the
+ * rest.  0 = one send per wakeup.
+ */
+static off_t send_budget = 8 << 20;
+
+/* How the body of a file is sent, chosen with --send-method.  SEND_PREAD
+ * reads into a buffer and send()s it, and is what's left where there's no
+ * sendfile(), or where sendfile() fails on the file.  Not used with
+ * --poller uring, which always splices.
+ */
+static enum { SEND_SENDFILE, SEND_SPLICE, SEND_PREAD } send_method =
+#if defined(__FreeBSD__) || defined(__linux) || defined(__sun__)
+    SEND_SENDFILE;
+#else
+    SEND_PREAD;
+#endif
+
+/* Rate limits on replies, in bytes per second, 0 = none: rate_limit for each
+ * connection, unless its URL starts with one of the rate_map prefixes, and
+ * client_rate_limit for all of a client's connections together, per event
+ * loop.  shaping is set if there are any.
+ */
+struct rate_mapping {
+    const char *prefix; /* points at argv */
+    size_t length;
+    off_t rate;
+};
+
+static off_t rate_limit = 0, client_rate_limit = 0;
+static struct rate_mapping *rate_map = NULL;
+static size_t rate_map_size = 0;
+static int shaping = 0;
+
+/* Keep up to file_cache_size bytes of files no bigger than
+ * file_cache_max_file in memory, and up to fd_cache_max other files open,
+ * per event loop.  0 = no cache.  Cached files are watched with inotify, or
+ * without it, checked with stat() every cache_ttl seconds.
+ */
+static size_t file_cache_size = 0, file_cache_max_file = 64 << 10;
+static size_t fd_cache_max = 0;
+static int want_precompressed = 0;
+
+/* --compress: compressed copies of text files up to compress_max_file go in
+ * the file cache too.
+ */
+static int want_compress = 0;
+#ifdef HAVE_COMPRESS
+static size_t compress_max_file = 1 << 20;
+#endif
+static int cache_ttl = 1, want_inotify = 1;
 static int syslog_enabled = 0;
 static volatile int running = 1; /* signal handler sets this to false */
 
+/* SIGINT and SIGTERM are blocked except while the loop is waiting, so that
+ * stopping can't slip in between checking running and going to sleep.
+ */
+static sigset_t loop_sigmask;
+
+#ifdef HAVE_THREADS
+/* --threads: one event loop per thread, each with its own listening socket
+ * bound with SO_REUSEPORT.  Counters are collected here at shutdown.
+ */
+struct loop_thread {
+    pthread_t thread;
+    int sockin;
+    uint64_t num_requests, total_in, total_out;
+    uint64_t num_accepts, accept_wakeups;
+    uint64_t conn_pool_hits, conn_pool_allocs;
+    uint64_t file_cache_hits, file_cache_misses, file_cache_evictions;
+    struct send_stats send_stats;
+};
+static int num_threads = 1;
+static struct loop_thread *threads = NULL;
+#endif
+
+/* --workers: pre-forked worker processes, each running the event loop on the
+ * inherited sockin, under a supervisor that respawns any that die.  The
+ * table is in shared memory so workers can leave their counters there.
+ */
+struct worker {
+    pid_t pid;          /* -1 if not running */
+    time_t started;
+    uint64_t num_requests, total_in, total_out;
+    uint64_t num_accepts, accept_wakeups;
+    uint64_t conn_pool_hits, conn_pool_allocs;
+    uint64_t file_cache_hits, file_cache_misses, file_cache_evictions;
+    struct send_stats send_stats;
+};
+static int num_workers = 0;         /* 0 = no supervisor, just run the loop */
+static struct worker *workers = NULL;
+
+/* Event loop backend, chosen with --poller.  select() is always available but
+ * is limited to FD_SETSIZE sockets and has to walk the connlist on every
+ * iteration.  Each loop starts out with poller_option, and falls back to
+ * epoll on its own if it can't have io_uring.
+ */
+enum poller { POLLER_SELECT, POLLER_EPOLL, POLLER_URING };
+static per_loop enum poller poller;
+static enum poller poller_option =
+#ifdef HAVE_EPOLL
+    POLLER_EPOLL;
+static per_loop int epoll_fd = -1;
+static per_loop int sockin_registered = 0; /* whether sockin is in epoll */
+
+/* Write interest is edge-triggered, so a connection that used up its send
+ * budget before the socket would block won't be reported again.  Those
+ * wait here to carry on in the next iteration.
+ */
+static per_loop LIST_HEAD(ready_list_head, connection) readylist =
+    LIST_HEAD_INITIALIZER(ready_list_head);
+#else
+    POLLER_SELECT;
+#endif
+
 #define INVALID_UID ((uid_t) -1)
 #define INVALID_GID ((gid_t) -1)
 
@@ -344,8 +717,28 @@ static const char *default_mimetype = octet_stream;
 
 /* Prototypes. */
 static void poll_recv_request(struct connection *conn);
+static void check_request(struct connection *conn);
+static void discard_input(const struct connection *conn);
 static void poll_send_header(struct connection *conn);
+static void handle_send_reply(struct connection *conn, const ssize_t sent);
+static void file_cache_unref(struct file_cache_entry *e);
+static void file_cache_catch_up(void);
+#ifdef HAVE_INOTIFY
+static void file_cache_unwatch(int wd);
+#endif
+static void shape_resume(struct connection *conn);
+static void client_bucket_put(struct client_bucket *c);
+#ifdef HAVE_COMPRESS
+static const char *compress_listing(struct connection *conn,
+        const char *path, const size_t stable_length);
+#endif
 static void poll_send_reply(struct connection *conn);
+static int poll_connection(struct connection *conn,
+        const int can_recv, const int can_send);
+#ifdef HAVE_IO_URING
+static void uring_close(struct connection *conn);
+static void uring_arm(struct connection *conn);
+#endif
 
 /* close() that dies on error.  */
 static void xclose(const int fd) {
@@ -479,6 +872,62 @@ static void nonblock_socket(const int sock) {
         err(1, "fcntl() to set O_NONBLOCK");
 }
 
+/* accept() a socket that's non-blocking and close-on-exec. */
+static int xaccept(const int sock, struct sockaddr *addr, socklen_t *len) {
+#ifdef HAVE_ACCEPT4
+    return accept4(sock, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int fd = accept(sock, addr, len);
+
+    if (fd != -1) {
+        nonblock_socket(fd);
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+            err(1, "fcntl() to set FD_CLOEXEC");
+    }
+    return fd;
+#endif
+}
+
+/* Empty the arena, freeing any chained blocks. */
+static void arena_reset(struct arena *a) {
+    struct arena_block *b;
+
+    while ((b = a->extra) != NULL) {
+        a->extra = b->next;
+        free(b);
+    }
+    a->pos = a->first;
+    a->end = a->first + sizeof(a->first);
+}
+
+/* Allocate len bytes from the arena. */
+static char *arena_alloc(struct arena *a, const size_t len) {
+    char *dest;
+
+    if ((size_t)(a->end - a->pos) < len) {
+        const size_t size = (len > ARENA_SIZE) ? len : ARENA_SIZE;
+        struct arena_block *b = xmalloc(sizeof(*b) + size);
+
+        b->next = a->extra;
+        a->extra = b;
+        a->pos = b->data;
+        a->end = b->data + size;
+    }
+    dest = a->pos;
+    a->pos += len;
+    return dest;
+}
+
+/* Copy len bytes of src into the arena as a null-terminated string. */
+static char *arena_strndup(struct arena *a, const char *src,
+        const size_t len) {
+    char *dest = arena_alloc(a, len + 1);
+
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+    return dest;
+}
+
 /* Split string out of src with range [left:right-1] */
 static char *split_string(const char *src,
         const size_t left, const size_t right) {
@@ -493,62 +942,104 @@ static char *split_string(const char *src,
     return dest;
 }
 
-/* Resolve /./ and /../ in a URL, in-place.
- * Returns NULL if the URL is invalid/unsafe, or the original buffer if
- * successful.
- */
-static char *make_safe_url(char *const url) {
-    char *src = url, *dst;
-    #define ends(c) ((c) == '/' || (c) == '\0')
+/* Value of each hex digit, or -1 for anything else. */
+static const signed char hex_digit[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+};
 
-    /* URLs not starting with a slash are illegal. */
-    if (*src != '/')
-        return NULL;
+/* Turn a URL into the path it names, in one pass: cut off the query string,
+ * decode %XX escapes, collapse multiple slashes and resolve /./ and /../.
+ * The path is written to dest, which needs strlen(url)+1 bytes and can be
+ * url itself.  url is cut off where the query string started.
+ * Returns NULL if the URL is invalid/unsafe, or dest if successful.
+ */
+static char *make_safe_url(char *const url, char *const dest) {
+    const unsigned char *src = (const unsigned char *)url;
+    char *dst = dest, *seg = dest + 1, *query, *ret = NULL;
+    int c;
 
-    /* Fast case: skip until first double-slash or dot-dir. */
-    for ( ; *src; ++src) {
-        if (*src == '/') {
-            if (src[1] == '/')
-                break;
-            else if (src[1] == '.') {
-                if (ends(src[2]))
-                    break;
-                else if (src[2] == '.' && ends(src[3]))
-                    break;
-            }
+    for (;;) {
+        /* Get the next decoded character, 0 at the end of the path. */
+        c = *src;
+        if (c == '?')
+            c = 0;
+        else if (c == '%' && hex_digit[src[1]] >= 0 &&
+                hex_digit[src[2]] >= 0) {
+            c = hex_digit[src[1]] * 16 + hex_digit[src[2]];
+            src += 3;
         }
-    }
+        else if (c != 0)
+            src++;
 
-    /* Copy to dst, while collapsing multi-slashes and handling dot-dirs. */
-    dst = src;
-    while (*src) {
-        if (*src != '/')
-            *dst++ = *src++;
-        else if (*++src == '/')
-            ;
-        else if (*src != '.')
+        /* URLs not starting with a slash are illegal. */
+        if (dst == dest) {
+            if (c != '/')
+                goto done;
             *dst++ = '/';
-        else if (ends(src[1]))
+            continue;
+        }
+        if (c != '/' && c != 0) {
+            *dst++ = (char)c;
+            continue;
+        }
+
+        /* End of a path component, which starts at seg. */
+        if (dst - seg == 1 && seg[0] == '.') {
             /* Ignore single-dot component. */
-            ++src;
-        else if (src[1] == '.' && ends(src[2])) {
-            /* Double-dot component. */
-            src += 2;
-            if (dst == url)
-                return NULL; /* Illegal URL */
-            else
-                /* Backtrack to previous slash. */
-                while (*--dst != '/' && dst > url);
+            dst = seg;
+            if (c == 0 && dst > dest + 1)
+                dst--;
         }
-        else
+        else if (dst - seg == 2 && seg[0] == '.' && seg[1] == '.') {
+            /* Double-dot component: drop the one before it. */
+            if (seg == dest + 1)
+                goto done; /* Illegal URL */
+            for (dst = seg - 1; dst[-1] != '/'; dst--)
+                ;
+            if (c == 0 && dst > dest + 1)
+                dst--;
+        }
+        else if (dst > seg && c == '/')
             *dst++ = '/';
-    }
+        /* else it's empty, from multiple slashes or a trailing one. */
 
-    if (dst == url)
-        ++dst;
+        if (c == 0)
+            break;
+        seg = dst;
+    }
     *dst = '\0';
-    return url;
-    #undef ends
+    ret = dest;
+
+done:
+    /* Cut off the query string, which might be further along if an unsafe
+     * URL or a %00 stopped us early.
+     */
+    if ((query = strchr((const char *)src, '?')) != NULL)
+        *query = '\0';
+    return ret;
+}
+
+static void add_rate_mapping(const char * const prefix, const off_t rate) {
+    rate_map_size++;
+    rate_map = xrealloc(rate_map, sizeof(*rate_map) * rate_map_size);
+    rate_map[rate_map_size - 1].prefix = prefix;
+    rate_map[rate_map_size - 1].length = strlen(prefix);
+    rate_map[rate_map_size - 1].rate = rate;
 }
 
 static void add_forward_mapping(const char * const host,
@@ -768,7 +1259,7 @@ static const char *url_content_type(const char *url) {
 static const char *get_address_text(const void *addr) {
 #ifdef HAVE_INET6
     if (inet6) {
-        static char text_addr[INET6_ADDRSTRLEN];
+        static per_loop char text_addr[INET6_ADDRSTRLEN];
         inet_ntop(AF_INET6, (const struct in6_addr *)addr, text_addr,
                   INET6_ADDRSTRLEN);
         return text_addr;
@@ -817,13 +1308,27 @@ static void init_sockin(void) {
                    &sockopt, sizeof(sockopt)) == -1)
         err(1, "setsockopt(SO_REUSEADDR)");
 
-#if 0
-    /* disable Nagle since we buffer everything ourselves */
+#ifdef HAVE_THREADS
+    /* every loop thread binds its own socket to the same port */
+    if (num_threads > 1) {
+# ifdef SO_REUSEPORT
+        sockopt = 1;
+        if (setsockopt(sockin, SOL_SOCKET, SO_REUSEPORT,
+                       &sockopt, sizeof(sockopt)) == -1)
+            err(1, "setsockopt(SO_REUSEPORT)");
+# else
+        errx(1, "--threads needs SO_REUSEPORT");
+# endif
+    }
+#endif
+
+    /* Disable Nagle, since each reply goes out in as few sends as we can
+     * manage anyway.  Accepted sockets inherit this.
+     */
     sockopt = 1;
     if (setsockopt(sockin, IPPROTO_TCP, TCP_NODELAY,
             &sockopt, sizeof(sockopt)) == -1)
         err(1, "setsockopt(TCP_NODELAY)");
-#endif
 
 #ifdef TORTURE
     /* torture: cripple the kernel-side send buffer so we can only squeeze out
@@ -884,6 +1389,36 @@ static void init_sockin(void) {
     }
 }
 
+#ifdef HAVE_THREADS
+/* Make another listening socket bound to the same address as sockin, for
+ * another loop thread.  The kernel spreads new connections across them.
+ */
+static int clone_sockin(void) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd, sockopt = 1;
+
+    if (getsockname(sockin, (struct sockaddr *)&addr, &addr_len) == -1)
+        err(1, "getsockname()");
+    fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1)
+        err(1, "socket()");
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+                   &sockopt, sizeof(sockopt)) == -1)
+        err(1, "setsockopt(SO_REUSEADDR)");
+# ifdef SO_REUSEPORT
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                   &sockopt, sizeof(sockopt)) == -1)
+        err(1, "setsockopt(SO_REUSEPORT)");
+# endif
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) == -1)
+        err(1, "bind(port %u)", bindport);
+    if (listen(fd, max_connections) == -1)
+        err(1, "listen()");
+    return fd;
+}
+#endif
+
 static void usage(const char *argv0) {
     printf("usage:\t%s /path/to/wwwroot [flags]\n\n", argv0);
     printf("flags:\t--port number (default: %u, or 80 if running as root)\n"
@@ -920,6 +1455,90 @@ static void usage(const char *argv0) {
     "\t\tand inside the wwwroot.\n\n");
     printf("\t--no-keepalive\n"
     "\t\tDisables HTTP Keep-Alive functionality.\n\n");
+    printf("\t--send-budget bytes (default: %lld)\n"
+    "\t\tKeep sending to a connection until its socket is full, or\n"
+    "\t\tit has been sent this many bytes, before moving on to the\n"
+    "\t\tnext.  Zero means one send at a time.\n\n",
+    (long long)send_budget);
+    printf("\t--rate-limit bytes (default: 0, no limit)\n"
+    "\t\tSend each reply at no more than this many bytes per second,\n"
+    "\t\tafter the first second's worth.\n\n");
+    printf("\t--rate-limit-path prefix bytes\n"
+    "\t\tUse this --rate-limit for URLs that start with prefix.  Can\n"
+    "\t\tbe given more than once: the longest prefix that matches is\n"
+    "\t\tthe one used.  Zero means no limit.\n\n");
+    printf("\t--client-rate-limit bytes (default: 0, no limit)\n"
+    "\t\tLimit the replies to each client IP, over all of its\n"
+    "\t\tconnections, to this many bytes per second.  This is per\n"
+    "\t\tevent loop, with --threads or --workers.\n\n");
+    printf("\t--cache-size bytes (default: 0, no cache)\n"
+    "\t\tKeep up to this many bytes of small files in memory, per\n"
+    "\t\tevent loop, and serve them from there.\n\n");
+    printf("\t--cache-max-file bytes (default: %zu)\n"
+    "\t\tOnly cache files up to this size.\n\n", file_cache_max_file);
+    printf("\t--fd-cache number (default: 0, no cache)\n"
+    "\t\tKeep up to this many other files open, per event loop, to\n"
+    "\t\tsave opening and stat()ing them for every request.\n\n");
+#ifdef HAVE_INOTIFY
+    printf("\t--no-inotify\n"
+    "\t\tDon't watch cached files with inotify, check them with\n"
+    "\t\tstat() instead.  For network filesystems.\n\n");
+#endif
+    printf("\t--cache-ttl seconds (default: %d)\n"
+    "\t\tWithout inotify, how long a cached file can go unchecked.\n"
+    "\t\tChanges can take this long to be noticed.\n\n", cache_ttl);
+    printf("\t--precompressed\n"
+    "\t\tIf the client accepts it, send file.br, file.zst or\n"
+    "\t\tfile.gz in place of file, when there's one no older.\n\n");
+#ifdef HAVE_COMPRESS
+    printf("\t--compress\n"
+    "\t\tCompress text files and directory listings for clients\n"
+    "\t\tthat accept it.  The first request for each is sent as it\n"
+    "\t\tis while a background thread compresses it into the cache.\n"
+    "\t\tNeeds --cache-size.\n\n");
+    printf("\t--compress-max-file bytes (default: %zu)\n"
+    "\t\tOnly compress files up to this size.\n\n", compress_max_file);
+#endif
+    printf("\t--conn-prealloc number (default: %d)\n"
+    "\t\tAllocate this many connections up front, per event loop.\n"
+    "\t\tMore are allocated as needed.\n\n", conn_prealloc);
+    printf("\t--accept-burst number (default: %d)\n"
+    "\t\tAccept at most this many connections each time the\n"
+    "\t\tlistening socket is ready.\n\n", accept_burst);
+    printf("\t--workers number (default: don't fork)\n"
+    "\t\tFork this many worker processes after initialization.  A\n"
+    "\t\tsupervisor respawns any that die.\n\n");
+#ifdef HAVE_THREADS
+    printf("\t--threads number (default: 1)\n"
+    "\t\tRun this many event loops, one per thread, each with its\n"
+    "\t\town listening socket (SO_REUSEPORT) and connections.\n\n");
+#endif
+#ifdef HAVE_EPOLL
+    printf("\t--poller select|epoll"
+# ifdef HAVE_IO_URING
+    "|uring"
+# endif
+    " (default: epoll)\n"
+    "\t\tWhich event loop backend to use.  select() is limited to\n"
+    "\t\t%d connections.\n", FD_SETSIZE);
+# ifdef HAVE_IO_URING
+    printf("\t\turing batches accept, recv, send and splice through\n"
+    "\t\tio_uring, and falls back to epoll if the kernel can't.\n");
+# endif
+    printf("\n");
+#endif
+    printf("\t--send-method "
+#if defined(__FreeBSD__) || defined(__linux) || defined(__sun__)
+    "sendfile|"
+#endif
+#ifdef HAVE_SPLICE
+    "splice|"
+#endif
+    "pread (default: %s)\n"
+    "\t\tHow to send files: sendfile(), splice() through a pipe, or\n"
+    "\t\tpread() into a buffer and send().  Ignored by --poller uring.\n"
+    "\t\tFiles that sendfile() can't handle fall back to pread.\n\n",
+    send_method == SEND_SENDFILE ? "sendfile" : "pread");
 #ifdef __FreeBSD__
     printf("\t--accf (default: don't use acceptfilter)\n"
     "\t\tUse acceptfilter.  Needs the accf_http module loaded.\n\n");
@@ -939,6 +1558,13 @@ static void usage(const char *argv0) {
     "\t\tIf a connection is idle for more than this many seconds,\n"
     "\t\tit will be closed. Set to zero to disable timeouts.\n\n",
     timeout_secs);
+    printf("\t--header-timeout secs (default: same as --timeout)\n"
+    "\t\tClose connections that haven't sent a whole request header\n"
+    "\t\twithin this many seconds of starting it, however slowly\n"
+    "\t\tit's trickling in. Set to zero to disable.\n\n");
+    printf("\t--send-timeout secs (default: same as --timeout)\n"
+    "\t\tClose connections that haven't taken any of the reply for\n"
+    "\t\tthis many seconds. Set to zero to disable.\n\n");
     printf("\t--auth username:password\n"
     "\t\tEnable basic authentication.\n\n");
 #ifdef HAVE_INET6
@@ -1145,6 +1771,16 @@ static void parse_commandline(const int argc, char *argv[]) {
                 errx(1, "missing number after --timeout");
             timeout_secs = (int)xstr_to_num(argv[i]);
         }
+        else if (strcmp(argv[i], "--header-timeout") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --header-timeout");
+            header_timeout_secs = (int)xstr_to_num(argv[i]);
+        }
+        else if (strcmp(argv[i], "--send-timeout") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --send-timeout");
+            send_timeout_secs = (int)xstr_to_num(argv[i]);
+        }
         else if (strcmp(argv[i], "--auth") == 0) {
             if (++i >= argc || strchr(argv[i], ':') == NULL)
                 errx(1, "missing 'user:pass' after --auth");
@@ -1153,6 +1789,128 @@ static void parse_commandline(const int argc, char *argv[]) {
             xasprintf(&auth_key, "Basic %s", key);
             free(key);
         }
+        else if (strcmp(argv[i], "--send-budget") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --send-budget");
+            send_budget = (off_t)xstr_to_num(argv[i]);
+        }
+        else if (strcmp(argv[i], "--rate-limit") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --rate-limit");
+            rate_limit = (off_t)xstr_to_num(argv[i]);
+        }
+        else if (strcmp(argv[i], "--rate-limit-path") == 0) {
+            const char *prefix;
+            if (++i >= argc)
+                errx(1, "missing prefix after --rate-limit-path");
+            prefix = argv[i];
+            if (++i >= argc)
+                errx(1, "missing number after --rate-limit-path");
+            add_rate_mapping(prefix, (off_t)xstr_to_num(argv[i]));
+        }
+        else if (strcmp(argv[i], "--client-rate-limit") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --client-rate-limit");
+            client_rate_limit = (off_t)xstr_to_num(argv[i]);
+        }
+        else if (strcmp(argv[i], "--cache-size") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --cache-size");
+            file_cache_size = (size_t)xstr_to_num(argv[i]);
+        }
+        else if (strcmp(argv[i], "--cache-max-file") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --cache-max-file");
+            file_cache_max_file = (size_t)xstr_to_num(argv[i]);
+        }
+        else if (strcmp(argv[i], "--fd-cache") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --fd-cache");
+            fd_cache_max = (size_t)xstr_to_num(argv[i]);
+        }
+        else if (strcmp(argv[i], "--precompressed") == 0) {
+            want_precompressed = 1;
+        }
+#ifdef HAVE_COMPRESS
+        else if (strcmp(argv[i], "--compress") == 0) {
+            want_compress = 1;
+        }
+        else if (strcmp(argv[i], "--compress-max-file") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --compress-max-file");
+            compress_max_file = (size_t)xstr_to_num(argv[i]);
+        }
+#endif
+        else if (strcmp(argv[i], "--no-inotify") == 0) {
+            want_inotify = 0;
+        }
+        else if (strcmp(argv[i], "--cache-ttl") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --cache-ttl");
+            cache_ttl = (int)xstr_to_num(argv[i]);
+        }
+        else if (strcmp(argv[i], "--conn-prealloc") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --conn-prealloc");
+            conn_prealloc = (int)xstr_to_num(argv[i]);
+        }
+        else if (strcmp(argv[i], "--accept-burst") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --accept-burst");
+            accept_burst = (int)xstr_to_num(argv[i]);
+            if (accept_burst < 1)
+                errx(1, "--accept-burst must be at least 1");
+        }
+        else if (strcmp(argv[i], "--workers") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --workers");
+            num_workers = (int)xstr_to_num(argv[i]);
+            if (num_workers < 1)
+                errx(1, "--workers must be at least 1");
+        }
+#ifdef HAVE_THREADS
+        else if (strcmp(argv[i], "--threads") == 0) {
+            if (++i >= argc)
+                errx(1, "missing number after --threads");
+            num_threads = (int)xstr_to_num(argv[i]);
+            if (num_threads < 1)
+                errx(1, "--threads must be at least 1");
+        }
+#endif
+        else if (strcmp(argv[i], "--poller") == 0) {
+            if (++i >= argc)
+                errx(1, "missing name after --poller");
+            if (strcmp(argv[i], "select") == 0)
+                poller_option = POLLER_SELECT;
+#ifdef HAVE_EPOLL
+            else if (strcmp(argv[i], "epoll") == 0)
+                poller_option = POLLER_EPOLL;
+#endif
+#ifdef HAVE_IO_URING
+            else if (strcmp(argv[i], "uring") == 0)
+                poller_option = POLLER_URING;
+#endif
+            else
+                errx(1, "unknown poller `%s'", argv[i]);
+        }
+        else if (strcmp(argv[i], "--send-method") == 0) {
+            if (++i >= argc)
+                errx(1, "missing name after --send-method");
+#if defined(__FreeBSD__) || defined(__linux) || defined(__sun__)
+            if (strcmp(argv[i], "sendfile") == 0)
+                send_method = SEND_SENDFILE;
+            else
+#endif
+#ifdef HAVE_SPLICE
+            if (strcmp(argv[i], "splice") == 0)
+                send_method = SEND_SPLICE;
+            else
+#endif
+            if (strcmp(argv[i], "pread") == 0)
+                send_method = SEND_PREAD;
+            else
+                errx(1, "unknown send method `%s'", argv[i]);
+        }
 #ifdef HAVE_INET6
         else if (strcmp(argv[i], "--ipv6") == 0) {
             inet6 = 1;
@@ -1161,42 +1919,377 @@ static void parse_commandline(const int argc, char *argv[]) {
         else
             errx(1, "unknown argument `%s'", argv[i]);
     }
+    if (header_timeout_secs < 0)
+        header_timeout_secs = timeout_secs;
+    if (send_timeout_secs < 0)
+        send_timeout_secs = timeout_secs;
+#ifdef HAVE_THREADS
+    if (num_workers > 0 && num_threads > 1)
+        errx(1, "--workers and --threads can't be combined");
+#endif
+    if (want_compress && file_cache_size == 0)
+        errx(1, "--compress needs --cache-size");
+    shaping = rate_limit > 0 || client_rate_limit > 0 || rate_map_size > 0;
 }
 
-/* Allocate and initialize an empty connection. */
-static struct connection *new_connection(void) {
-    struct connection *conn = xmalloc(sizeof(struct connection));
+/* Update the cached clocks. */
+static void update_clock(void) {
+    struct timespec ts;
 
-    conn->socket = -1;
-    memset(&conn->client, 0, sizeof(conn->client));
-    conn->last_active = now;
-    conn->request = NULL;
-    conn->request_length = 0;
-    conn->method = NULL;
-    conn->url = NULL;
-    conn->referer = NULL;
-    conn->user_agent = NULL;
-    conn->authorization = NULL;
-    conn->range_begin = 0;
-    conn->range_end = 0;
-    conn->range_begin_given = 0;
-    conn->range_end_given = 0;
-    conn->header = NULL;
-    conn->header_length = 0;
-    conn->header_sent = 0;
-    conn->header_dont_free = 0;
-    conn->header_only = 0;
-    conn->http_code = 0;
-    conn->conn_close = 1;
-    conn->reply = NULL;
-    conn->reply_dont_free = 0;
-    conn->reply_fd = -1;
-    conn->reply_start = 0;
-    conn->reply_length = 0;
-    conn->reply_sent = 0;
-    conn->total_sent = 0;
+    now = time(NULL);
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        err(1, "clock_gettime()");
+    now_ms = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-    /* Make it harmless so it gets garbage-collected if it should, for some
+/* File conn in the timer wheel by its deadline. */
+static void timer_file(struct connection *conn) {
+    const uint64_t max = (uint64_t)1 << (TIMER_BITS * TIMER_LEVELS);
+    uint64_t expires = (conn->deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    uint64_t delta;
+    int level;
+
+    if (expires < wheel.tick)
+        expires = wheel.tick;
+    delta = expires - wheel.tick;
+    if (delta >= max) {
+        /* too far out: it'll get re-filed when this comes up */
+        delta = max - 1;
+        expires = wheel.tick + delta;
+    }
+    for (level = 0; level < TIMER_LEVELS - 1; level++)
+        if (delta < (uint64_t)1 << (TIMER_BITS * (level + 1)))
+            break;
+    conn->timer_tick = expires;
+    LIST_INSERT_HEAD(&wheel.slot[level][
+        (expires >> (TIMER_BITS * level)) & TIMER_MASK], conn, timer_entries);
+}
+
+/* Take conn out of the timer wheel. */
+static void timer_cancel(struct connection *conn) {
+    if (conn->timer == TIMER_NONE)
+        return;
+    LIST_REMOVE(conn, timer_entries);
+    wheel.count--;
+    conn->timer = TIMER_NONE;
+}
+
+/* (Re)start conn's timer, of the given kind, to go off at deadline. */
+static void timer_at(struct connection *conn, const int kind,
+        const uint64_t deadline) {
+    if (conn->timer != TIMER_NONE &&
+            deadline >= conn->timer_tick * TIMER_TICK_MS) {
+        /* later than it's filed for: fix that up when it comes round */
+        conn->timer = kind;
+        conn->deadline = deadline;
+        return;
+    }
+    timer_cancel(conn);
+    if (wheel.count++ == 0)
+        wheel.tick = now_ms / TIMER_TICK_MS; /* catch up the empty wheel */
+    conn->timer = kind;
+    conn->deadline = deadline;
+    timer_file(conn);
+}
+
+/* (Re)start conn's deadline, of the given kind, from now. */
+static void timer_set(struct connection *conn, const int kind) {
+    int secs;
+
+    switch (kind) {
+    case TIMER_HEADER: secs = header_timeout_secs; break;
+    case TIMER_IDLE: secs = timeout_secs; break;
+    case TIMER_SEND: secs = send_timeout_secs; break;
+    default: secs = 0;
+    }
+    if (secs <= 0) {
+        timer_cancel(conn);
+        return;
+    }
+    timer_at(conn, kind, now_ms + (uint64_t)secs * 1000);
+}
+
+/* How long until timers_run() has work to do, in ms, or -1 for never. */
+static int timer_next_ms(void) {
+    uint64_t t = wheel.tick;
+
+    if (wheel.count == 0)
+        return -1;
+    /* Look for the next occupied slot in this turn of level 0.  If there
+     * isn't one, wake up for the cascade at the start of the next turn.
+     */
+    while ((t & TIMER_MASK) != 0 &&
+            LIST_FIRST(&wheel.slot[0][t & TIMER_MASK]) == NULL)
+        t++;
+    if (t * TIMER_TICK_MS <= now_ms)
+        return 0;
+    return (int)(t * TIMER_TICK_MS - now_ms);
+}
+
+/* conn's deadline of the given kind has passed: kill it off, or if it was
+ * only parked by its rate limit, carry on.
+ */
+static void timer_expired(struct connection *conn, const int kind) {
+    if (kind == TIMER_SHAPE) {
+        shape_resume(conn);
+        return;
+    }
+    if (debug)
+        printf("timer_expired(%d) %s timeout, closing connection\n",
+            conn->socket,
+            kind == TIMER_HEADER ? "header" :
+            kind == TIMER_IDLE ? "idle" : "send");
+    conn->conn_close = 1;
+    conn->state = DONE;
+#ifdef HAVE_IO_URING
+    if (poller == POLLER_URING) {
+        uring_close(conn);
+        return;
+    }
+#endif
+    poll_connection(conn, 0, 0);
+}
+
+/* Run the wheel up to now, closing connections whose deadline has
+ * passed.
+ */
+static void timers_run(void) {
+    const uint64_t now_tick = now_ms / TIMER_TICK_MS;
+    struct timer_slot *slot;
+    struct connection *conn;
+    int level, kind;
+
+    while (wheel.count > 0 && wheel.tick <= now_tick) {
+        /* At the start of a turn, cascade the next slot from the level
+         * above.  Highest level first, so it can cascade all the way down.
+         */
+        for (level = TIMER_LEVELS - 1; level > 0; level--) {
+            if ((wheel.tick &
+                    (((uint64_t)1 << (TIMER_BITS * level)) - 1)) != 0)
+                continue;
+            slot = &wheel.slot[level][
+                (wheel.tick >> (TIMER_BITS * level)) & TIMER_MASK];
+            while ((conn = LIST_FIRST(slot)) != NULL) {
+                LIST_REMOVE(conn, timer_entries);
+                timer_file(conn);
+            }
+        }
+
+        slot = &wheel.slot[0][wheel.tick & TIMER_MASK];
+        wheel.tick++;
+        while ((conn = LIST_FIRST(slot)) != NULL) {
+            LIST_REMOVE(conn, timer_entries);
+            if (conn->deadline > now_ms) {
+                timer_file(conn); /* was pushed back */
+                continue;
+            }
+            wheel.count--;
+            kind = conn->timer;
+            conn->timer = TIMER_NONE;
+            if (conn->state != DONE) /* else it's already closing */
+                timer_expired(conn, kind);
+        }
+    }
+}
+
+/* Connections are carved out of slabs, and go on a free list when they're
+ * closed, so accepting and closing doesn't cost a malloc() and free().  Each
+ * loop starts with a slab of conn_prealloc, and grows by CONN_SLAB at a time.
+ */
+#define CONN_SLAB 64
+
+struct conn_slab {
+    struct conn_slab *next;
+    struct connection conns[];
+};
+
+static per_loop struct conn_slab *conn_slabs = NULL;
+static per_loop struct conn_list_head conn_pool =
+    LIST_HEAD_INITIALIZER(conn_list_head);
+
+/* Add a slab of n connections to the pool. */
+static void conn_pool_grow(const int n) {
+    struct conn_slab *slab =
+        xmalloc(sizeof(*slab) + (size_t)n * sizeof(struct connection));
+    int i;
+
+    slab->next = conn_slabs;
+    conn_slabs = slab;
+    for (i = n - 1; i >= 0; i--) {
+        slab->conns[i].pooled = 0;
+        LIST_INSERT_HEAD(&conn_pool, &slab->conns[i], entries);
+    }
+}
+
+/* Free the pool, once all its connections have been put back. */
+static void conn_pool_destroy(void) {
+    struct conn_slab *slab;
+
+    while ((slab = conn_slabs) != NULL) {
+        conn_slabs = slab->next;
+        free(slab);
+    }
+    LIST_INIT(&conn_pool);
+}
+
+/* Get a connection from the pool.  It's a hit if it's been used before,
+ * otherwise it counts as an allocation, whether or not it was preallocated.
+ */
+static struct connection *conn_pool_get(void) {
+    struct connection *conn = LIST_FIRST(&conn_pool);
+
+    if (conn == NULL) {
+        conn_pool_grow(CONN_SLAB);
+        conn = LIST_FIRST(&conn_pool);
+    }
+    if (conn->pooled)
+        conn_pool_hits++;
+    else
+        conn_pool_allocs++;
+    LIST_REMOVE(conn, entries);
+    return conn;
+}
+
+/* Return a connection, already cleaned out by free_connection(), to the
+ * pool.
+ */
+static void conn_pool_put(struct connection *conn) {
+    conn->pooled = 1;
+    LIST_INSERT_HEAD(&conn_pool, conn, entries);
+}
+
+/* Buffers for sending files with pread() and send().  Whatever the socket
+ * didn't take stays in the connection's buffer for next time; an empty
+ * buffer goes back to the pool.
+ */
+#define SEND_BUF_SIZE (64 << 10)
+
+struct send_buf {
+    struct send_buf *next;
+    off_t ofs;              /* file offset of data[start] */
+    size_t start, length;   /* what's still to be sent */
+    char data[SEND_BUF_SIZE];
+};
+
+static per_loop struct send_buf *send_buf_pool = NULL;
+
+static struct send_buf *send_buf_get(void) {
+    struct send_buf *buf = send_buf_pool;
+
+    if (buf == NULL)
+        buf = xmalloc(sizeof(*buf));
+    else
+        send_buf_pool = buf->next;
+    buf->start = buf->length = 0;
+    return buf;
+}
+
+static void send_buf_put(struct send_buf *buf) {
+    buf->next = send_buf_pool;
+    send_buf_pool = buf;
+}
+
+/* Make sure conn's buffer holds the len bytes of reply_fd from ofs, reading
+ * them if it doesn't already.  Returns NULL if they can't be read.
+ */
+static struct send_buf *send_buf_fill(struct connection *conn,
+        const off_t ofs, const size_t len) {
+    struct send_buf *buf = conn->send_buf;
+
+    assert(len <= SEND_BUF_SIZE);
+    if (buf != NULL && buf->ofs == ofs && buf->length >= len)
+        return buf;
+    if (buf == NULL)
+        buf = conn->send_buf = send_buf_get();
+    if (pread(conn->reply_fd, buf->data, len, ofs) != (ssize_t)len) {
+        send_buf_put(buf);
+        conn->send_buf = NULL;
+        return NULL;
+    }
+    buf->ofs = ofs;
+    buf->start = 0;
+    buf->length = len;
+    return buf;
+}
+
+static void send_buf_pool_destroy(void) {
+    struct send_buf *buf;
+
+    while ((buf = send_buf_pool) != NULL) {
+        send_buf_pool = buf->next;
+        free(buf);
+    }
+}
+
+/* Reset the fields for the request and its reply. */
+static void reset_request(struct connection *conn) {
+    conn->request_length = 0;
+    conn->header_scan = 0;
+    memset(conn->fields, 0, sizeof(conn->fields));
+    conn->method = NULL;
+    conn->url = NULL;
+    conn->decoded_url = NULL;
+    conn->referer = NULL;
+    conn->user_agent = NULL;
+    conn->authorization = NULL;
+    conn->range_begin = 0;
+    conn->range_end = 0;
+    conn->range_begin_given = 0;
+    conn->send_fallback = 0;
+    conn->range_end_given = 0;
+    conn->num_ranges = 0;
+    conn->header = NULL;
+    conn->header_length = 0;
+    conn->header_sent = 0;
+    conn->header_dont_free = 0;
+    conn->header_only = 0;
+    conn->http_code = 0;
+    conn->conn_close = 1;
+    conn->reply = NULL;
+    conn->reply_dont_free = 0;
+    conn->reply_fd = -1;
+    conn->reply_start = 0;
+    conn->reply_length = 0;
+    conn->reply_sent = 0;
+    conn->total_sent = 0;
+    conn->multipart = NULL;
+    conn->multipart_length = 0;
+    conn->shaped = 0;
+}
+
+/* Allocate and initialize an empty connection. */
+static struct connection *new_connection(void) {
+    struct connection *conn = conn_pool_get();
+
+    conn->socket = -1;
+    memset(&conn->client, 0, sizeof(conn->client));
+#ifdef HAVE_EPOLL
+    conn->events = 0;
+    conn->send_ready = 0;
+#endif
+#ifdef HAVE_IO_URING
+    conn->uring_inflight = 0;
+    conn->uring_pollout = 0;
+    conn->uring_charged = 0;
+#endif
+#ifdef HAVE_SPLICE
+    conn->pipe[0] = conn->pipe[1] = -1;
+    conn->pipe_pending = 0;
+#endif
+    conn->send_buf = NULL;
+    conn->timer = TIMER_NONE;
+    conn->deadline = 0;
+    conn->timer_tick = 0;
+    conn->bucket.tokens = 0;
+    conn->bucket.refill_ms = 0;
+    conn->client_bucket = NULL;
+    conn->cache_entry = NULL;
+    conn->arena.extra = NULL;
+    arena_reset(&conn->arena);
+    reset_request(conn);
+    conn->pipelined = 0;
+
+    /* Make it harmless so it gets garbage-collected if it should, for some
      * reason, fail to be correctly filled out.
      */
     conn->state = DONE;
@@ -1204,8 +2297,10 @@ static struct connection *new_connection(void) {
     return conn;
 }
 
-/* Accept a connection from sockin and add it to the connection queue. */
-static void accept_connection(void) {
+/* Accept a connection from sockin and add it to the connection queue.
+ * Returns 0 if there's nothing more to accept for now.
+ */
+static int accept_one(void) {
     struct sockaddr_in addrin;
 #ifdef HAVE_INET6
     struct sockaddr_in6 addrin6;
@@ -1218,26 +2313,37 @@ static void accept_connection(void) {
     if (inet6) {
         sin_size = sizeof(addrin6);
         memset(&addrin6, 0, sin_size);
-        fd = accept(sockin, (struct sockaddr *)&addrin6, &sin_size);
+        fd = xaccept(sockin, (struct sockaddr *)&addrin6, &sin_size);
     } else
 #endif
     {
         sin_size = sizeof(addrin);
         memset(&addrin, 0, sin_size);
-        fd = accept(sockin, (struct sockaddr *)&addrin, &sin_size);
+        fd = xaccept(sockin, (struct sockaddr *)&addrin, &sin_size);
     }
 
     if (fd == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0; /* backlog is empty */
+        if (errno == ECONNABORTED)
+            return 1; /* gone already, try the next one */
         /* Failed to accept, but try to keep serving existing connections. */
         if (errno == EMFILE || errno == ENFILE) accepting = 0;
         warn("accept()");
-        return;
+        return 0;
+    }
+    num_accepts++;
+    if (poller == POLLER_SELECT && fd >= FD_SETSIZE) {
+        /* select() can't watch this socket, so we can't serve it. */
+        fprintf(stderr, "fd %d exceeds FD_SETSIZE, dropping connection\n",
+            fd);
+        xclose(fd);
+        return 1;
     }
 
     /* Allocate and initialize struct connection. */
     conn = new_connection();
     conn->socket = fd;
-    nonblock_socket(conn->socket);
     conn->state = RECV_REQUEST;
 
 #ifdef HAVE_INET6
@@ -1249,6 +2355,7 @@ static void accept_connection(void) {
         *(in_addr_t *)&conn->client = addrin.sin_addr.s_addr;
     }
     LIST_INSERT_HEAD(&connlist, conn, entries);
+    timer_set(conn, TIMER_HEADER);
 
     if (debug)
         printf("accepted connection from %s:%u (fd %d)\n",
@@ -1257,9 +2364,30 @@ static void accept_connection(void) {
                conn->socket);
 
     /* Try to read straight away rather than going through another iteration
-     * of the select() loop.
+     * of the event loop.
      */
-    poll_recv_request(conn);
+    poll_connection(conn, 1, 0);
+    return 1;
+}
+
+/* sockin is readable: drain up to accept_burst connections from the backlog
+ * rather than going back to the poller for each one.
+ */
+static void accept_connection(void) {
+    int i;
+
+    accept_wakeups++;
+    for (i = 0; i < accept_burst && accepting; i++) {
+        /* Anything after the first could have come in after the poller
+         * returned, and so after a change to a cached file that it didn't
+         * get to say anything about.  Once a burst is enough to keep this
+         * off the accept path.
+         */
+        if (i == 1)
+            file_cache_catch_up();
+        if (!accept_one())
+            break;
+    }
 }
 
 /* Should this character be logencoded?
@@ -1292,8 +2420,9 @@ static void logencode(const char *src, char *dest) {
 #define CLF_DATE_LEN 29 /* strlen("[10/Oct/2000:13:55:36 -0700]")+1 */
 static char *clf_date(char *dest, const time_t when) {
     time_t when_copy = when;
+    struct tm tm;
     if (strftime(dest, CLF_DATE_LEN,
-                 "[%d/%b/%Y:%H:%M:%S %z]", localtime(&when_copy)) == 0)
+                 "[%d/%b/%Y:%H:%M:%S %z]", localtime_r(&when_copy, &tm)) == 0)
         errx(1, "strftime() failed [%s]", dest);
     return dest;
 }
@@ -1365,15 +2494,42 @@ static void log_connection(const struct connection *conn) {
 static void free_connection(struct connection *conn) {
     if (debug) printf("free_connection(%d)\n", conn->socket);
     log_connection(conn);
-    if (conn->socket != -1) xclose(conn->socket);
-    if (conn->request != NULL) free(conn->request);
-    if (conn->method != NULL) free(conn->method);
-    if (conn->url != NULL) free(conn->url);
-    if (conn->referer != NULL) free(conn->referer);
-    if (conn->user_agent != NULL) free(conn->user_agent);
-    if (conn->authorization != NULL) free(conn->authorization);
+    timer_cancel(conn);
+#ifdef HAVE_EPOLL
+    if (conn->send_ready) {
+        LIST_REMOVE(conn, ready_entries);
+        conn->send_ready = 0;
+    }
+#endif
+#ifdef HAVE_SPLICE
+    /* The splice pipe lives as long as the socket. */
+    if (conn->socket != -1 && conn->pipe[0] != -1) {
+        xclose(conn->pipe[0]);
+        xclose(conn->pipe[1]);
+        conn->pipe[0] = conn->pipe[1] = -1;
+        conn->pipe_pending = 0;
+    }
+#endif
+    if (conn->send_buf != NULL) {
+        send_buf_put(conn->send_buf);
+        conn->send_buf = NULL;
+    }
+    if (conn->socket != -1) {
+        xclose(conn->socket);
+        if (conn->client_bucket != NULL) {
+            client_bucket_put(conn->client_bucket);
+            conn->client_bucket = NULL;
+        }
+    }
+    arena_reset(&conn->arena); /* method, url, referer, etc. */
     if (conn->header != NULL && !conn->header_dont_free) free(conn->header);
     if (conn->reply != NULL && !conn->reply_dont_free) free(conn->reply);
+    if (conn->cache_entry != NULL) {
+        /* reply_fd, if any, belongs to it */
+        file_cache_unref(conn->cache_entry);
+        conn->cache_entry = NULL;
+        conn->reply_fd = -1;
+    }
     if (conn->reply_fd != -1) xclose(conn->reply_fd);
     /* If we ran out of sockets, try to resume accepting. */
     accepting = 1;
@@ -1382,6 +2538,7 @@ static void free_connection(struct connection *conn) {
 /* Recycle a finished connection for HTTP/1.1 Keep-Alive. */
 static void recycle_connection(struct connection *conn) {
     int socket_tmp = conn->socket;
+    size_t header_length;
     if (debug)
         printf("recycle_connection(%d)\n", socket_tmp);
     conn->socket = -1; /* so free_connection() doesn't close it */
@@ -1389,33 +2546,24 @@ static void recycle_connection(struct connection *conn) {
     conn->socket = socket_tmp;
 
     /* don't reset conn->client */
-    conn->request = NULL;
-    conn->request_length = 0;
-    conn->method = NULL;
-    conn->url = NULL;
-    conn->referer = NULL;
-    conn->user_agent = NULL;
-    conn->authorization = NULL;
-    conn->range_begin = 0;
-    conn->range_end = 0;
-    conn->range_begin_given = 0;
-    conn->range_end_given = 0;
-    conn->header = NULL;
-    conn->header_length = 0;
-    conn->header_sent = 0;
-    conn->header_dont_free = 0;
-    conn->header_only = 0;
-    conn->http_code = 0;
-    conn->conn_close = 1;
-    conn->reply = NULL;
-    conn->reply_dont_free = 0;
-    conn->reply_fd = -1;
-    conn->reply_start = 0;
-    conn->reply_length = 0;
-    conn->reply_sent = 0;
-    conn->total_sent = 0;
+    header_length = conn->request_length;
+    reset_request(conn);
 
     conn->state = RECV_REQUEST; /* ready for another */
+    if (conn->pipelined == 0) {
+        timer_set(conn, TIMER_IDLE);
+        return;
+    }
+
+    /* Move the next request to the front, and deal with it now if it's all
+     * here, since no more input might ever arrive to wake us up for it.
+     */
+    memmove(conn->request, conn->request + header_length, conn->pipelined);
+    conn->request[0] = conn->pipelined_first;
+    conn->request_length = conn->pipelined;
+    conn->pipelined = 0;
+    timer_set(conn, TIMER_HEADER);
+    check_request(conn);
 }
 
 /* Uppercasify all characters in a string of given length. */
@@ -1426,19 +2574,10 @@ static void strntoupper(char *str, const size_t length) {
         str[i] = (char)toupper(str[i]);
 }
 
-/* If a connection has been idle for more than timeout_secs, it will be
- * marked as DONE and killed off in httpd_poll().
- */
-static void poll_check_timeout(struct connection *conn) {
-    if (timeout_secs > 0) {
-        if (now - conn->last_active >= timeout_secs) {
-            if (debug)
-                printf("poll_check_timeout(%d) closing connection\n",
-                       conn->socket);
-            conn->conn_close = 1;
-            conn->state = DONE;
-        }
-    }
+/* Write n as two digits. */
+static void two_digits(char *dest, const int n) {
+    dest[0] = (char)('0' + n / 10);
+    dest[1] = (char)('0' + n % 10);
 }
 
 /* Format [when] as an RFC1123 date, stored in the specified buffer.  The same
@@ -1446,41 +2585,137 @@ static void poll_check_timeout(struct connection *conn) {
  */
 #define DATE_LEN 30 /* strlen("Fri, 28 Feb 2003 00:02:08 GMT")+1 */
 static char *rfc1123_date(char *dest, const time_t when) {
+    static const char days[] = "SunMonTueWedThuFriSat",
+        months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
     time_t when_copy = when;
-    if (strftime(dest, DATE_LEN,
-                 "%a, %d %b %Y %H:%M:%S GMT", gmtime(&when_copy)) == 0)
-        errx(1, "strftime() failed [%s]", dest);
+    struct tm tm;
+    int year;
+
+    if (gmtime_r(&when_copy, &tm) == NULL)
+        errx(1, "gmtime_r() failed");
+    year = tm.tm_year + 1900;
+    if (year < 0)
+        year = 0;
+    else if (year > 9999)
+        year = 9999;
+    memcpy(dest, days + 3 * tm.tm_wday, 3);
+    memcpy(dest + 3, ", ", 2);
+    two_digits(dest + 5, tm.tm_mday);
+    dest[7] = ' ';
+    memcpy(dest + 8, months + 3 * tm.tm_mon, 3);
+    dest[11] = ' ';
+    two_digits(dest + 12, year / 100);
+    two_digits(dest + 14, year % 100);
+    dest[16] = ' ';
+    two_digits(dest + 17, tm.tm_hour);
+    dest[19] = ':';
+    two_digits(dest + 20, tm.tm_min);
+    dest[22] = ':';
+    two_digits(dest + 23, tm.tm_sec);
+    memcpy(dest + 25, " GMT", 5);
     return dest;
 }
 
-/* Decode URL by converting %XX (where XX are hexadecimal digits) to the
- * character it represents.  Don't forget to free the return value.
+/* The current date, formatted again only when now changes. */
+static per_loop char date_buf[DATE_LEN];
+static per_loop time_t date_when = -1;
+static const char *date_now(void) {
+    if (date_when != now) {
+        rfc1123_date(date_buf, now);
+        date_when = now;
+    }
+    return date_buf;
+}
+
+/* Parse an HTTP date in any of the three formats RFC 9110 says to accept:
+ *   Sun, 06 Nov 1994 08:49:37 GMT   (IMF-fixdate, what we send)
+ *   Sunday, 06-Nov-94 08:49:37 GMT  (obsolete RFC 850)
+ *   Sun Nov  6 08:49:37 1994        (asctime)
+ * Returns -1 if it's none of them.
  */
-static char *urldecode(const char *url) {
-    size_t i, pos, len = strlen(url);
-    char *out = xmalloc(len+1);
+static time_t parse_http_date(const char *s) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const size_t len = strlen(s);
+    char month[4];
+    const char *m;
+    int day, mon, year, hour, min, sec, n = 0, y, era, yoe, doy, doe;
+
+    if ((sscanf(s, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT%n",
+                &day, month, &year, &hour, &min, &sec, &n) != 6 ||
+            (size_t)n != len) &&
+        (sscanf(s, "%*[A-Za-z], %2d-%3s-%2d %2d:%2d:%2d GMT%n",
+                &day, month, &year, &hour, &min, &sec, &n) != 6 ||
+            (size_t)n != len) &&
+        (sscanf(s, "%*3s %3s %2d %2d:%2d:%2d %4d%n",
+                month, &day, &hour, &min, &sec, &year, &n) != 6 ||
+            (size_t)n != len))
+        return -1;
+    if (year < 100)
+        year += (year < 70) ? 2000 : 1900;
+    if (strlen(month) != 3 || (m = strstr(months, month)) == NULL ||
+            (m - months) % 3 != 0)
+        return -1;
+    mon = (int)(m - months) / 3 + 1;
+    if (year < 1970 || day < 1 || day > 31 || hour > 23 || min > 59 ||
+            sec > 60)
+        return -1;
 
-    for (i = 0, pos = 0; i < len; i++) {
-        if ((url[i] == '%') && (i+2 < len) &&
-            isxdigit(url[i+1]) && isxdigit(url[i+2])) {
-            /* decode %XX */
-#define HEX_TO_DIGIT(hex) ( \
-    ((hex) >= 'A' && (hex) <= 'F') ? ((hex)-'A'+10): \
-    ((hex) >= 'a' && (hex) <= 'f') ? ((hex)-'a'+10): \
-    ((hex)-'0') )
+    /* Days since the epoch, the way Howard Hinnant's days_from_civil()
+     * does it: count from March, so the leap day comes last.
+     */
+    y = year - (mon <= 2);
+    era = y / 400;
+    yoe = y - era * 400;
+    doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return ((time_t)era * 146097 + doe - 719468) * 86400 +
+        hour * 3600 + min * 60 + sec;
+}
 
-            out[pos++] = HEX_TO_DIGIT(url[i+1]) * 16 +
-                         HEX_TO_DIGIT(url[i+2]);
-            i += 2;
-#undef HEX_TO_DIGIT
-        } else {
-            /* straight copy */
-            out[pos++] = url[i];
-        }
-    }
-    out[pos] = '\0';
-    return out;
+/* A strong ETag for a file, from what stat() says about it:
+ * "ino-size-mtime-nsec" in hex.  The nanoseconds tell apart two versions of
+ * the same size written in the same second, which If-Range relies on.
+ * There's room for etag_add_encoding() on the end.
+ */
+#define ETAG_LEN (4 * 16 + 5 + 5 + 1)
+static char *hex_number(char *dest, unsigned long long n) {
+    char buf[16];
+    int i = 0;
+
+    do {
+        buf[i++] = "0123456789abcdef"[n & 15];
+        n >>= 4;
+    } while (n != 0);
+    while (i > 0)
+        *dest++ = buf[--i];
+    return dest;
+}
+
+static void make_etag(char *dest, const struct stat *st) {
+    *dest++ = '"';
+    dest = hex_number(dest, llu(st->st_ino));
+    *dest++ = '-';
+    dest = hex_number(dest, llu(st->st_size));
+    *dest++ = '-';
+    dest = hex_number(dest, llu(st->st_mtime));
+    *dest++ = '-';
+    dest = hex_number(dest, llu(st->st_mtim.tv_nsec));
+    *dest++ = '"';
+    *dest = '\0';
+}
+
+#ifdef HAVE_COMPRESS
+/* A compressed copy is a different representation, so it gets its own tag:
+ * "ino-size-mtime-nsec-gzip".
+ */
+static void etag_add_encoding(char *etag, const char *encoding) {
+    const size_t len = strlen(etag);
+
+    etag[len - 1] = '-';
+    strcpy(etag + len, encoding);
+    strcat(etag, "\"");
 }
+#endif
 
 /* Returns Connection or Keep-Alive header, depending on conn_close. */
 static const char *keep_alive(const struct connection *conn)
@@ -1488,10 +2723,62 @@ static const char *keep_alive(const struct connection *conn)
     return (conn->conn_close ? "Connection: close\r\n" : keep_alive_field);
 }
 
+/* Append len bytes to conn's response header, keeping it null-terminated. */
+static void header_appendl(struct connection *conn, const char *s,
+        const size_t len) {
+    if (conn->header_length + len >= conn->header_size) {
+        char *header;
+
+        while (conn->header_length + len >= conn->header_size)
+            conn->header_size *= 2;
+        header = arena_alloc(&conn->arena, conn->header_size);
+        memcpy(header, conn->header, conn->header_length);
+        conn->header = header;
+    }
+    memcpy(conn->header + conn->header_length, s, len);
+    conn->header_length += len;
+    conn->header[conn->header_length] = '\0';
+}
+
+#define header_literal(conn, s) header_appendl(conn, s, sizeof(s) - 1)
+
+static void header_append(struct connection *conn, const char *s) {
+    header_appendl(conn, s, strlen(s));
+}
+
+static void header_number(struct connection *conn, unsigned long long n) {
+    char buf[20], *p = buf + sizeof(buf);
+
+    do {
+        *--p = (char)('0' + n % 10);
+        n /= 10;
+    } while (n != 0);
+    header_appendl(conn, p, (size_t)(buf + sizeof(buf) - p));
+}
+
+/* Start a response header with the status line, and the Date and Server
+ * fields.
+ */
+static void header_start(struct connection *conn,
+        const int code, const char *name) {
+    conn->header = conn->header_buf;
+    conn->header_size = sizeof(conn->header_buf);
+    conn->header_length = 0;
+    conn->header_dont_free = 1;
+    header_literal(conn, "HTTP/1.1 ");
+    header_number(conn, (unsigned long long)code);
+    header_literal(conn, " ");
+    header_append(conn, name);
+    header_literal(conn, "\r\nDate: ");
+    header_appendl(conn, date_now(), DATE_LEN - 1);
+    header_literal(conn, "\r\n");
+    header_appendl(conn, server_hdr, server_hdr_len);
+}
+
 /* "Generated by " + pkgname + " on " + date + "\n"
  *  1234567890123               1234            2 ('\n' and '\0')
  */
-static char _generated_on_buf[13 + sizeof(pkgname) - 1 + 4 + DATE_LEN + 2];
+static per_loop char _generated_on_buf[13 + sizeof(pkgname) - 1 + 4 + DATE_LEN + 2];
 static const char *generated_on(const char date[DATE_LEN]) {
     if (!want_server_id)
         return "";
@@ -1507,16 +2794,13 @@ static void default_reply(struct connection *conn,
         __printflike(4, 5);
 static void default_reply(struct connection *conn,
         const int errcode, const char *errname, const char *format, ...) {
-    char *reason, date[DATE_LEN];
+    char *reason;
     va_list va;
 
     va_start(va, format);
     xvasprintf(&reason, format, va);
     va_end(va);
 
-    /* Only really need to calculate the date once. */
-    rfc1123_date(date, now);
-
     conn->reply_length = xasprintf(&(conn->reply),
      "<html><head><title>%d %s</title></head><body>\n"
      "<h1>%s</h1>\n" /* errname */
@@ -1524,46 +2808,39 @@ static void default_reply(struct connection *conn,
      "<hr>\n"
      "%s" /* generated on */
      "</body></html>\n",
-     errcode, errname, errname, reason, generated_on(date));
+     errcode, errname, errname, reason, generated_on(date_now()));
     free(reason);
 
-    const char auth_header[] =
-        "WWW-Authenticate: Basic realm=\"User Visible Realm\"\r\n";
-
-    conn->header_length = xasprintf(&(conn->header),
-     "HTTP/1.1 %d %s\r\n"
-     "Date: %s\r\n"
-     "%s" /* server */
-     "Accept-Ranges: bytes\r\n"
-     "%s" /* keep-alive */
-     "Content-Length: %llu\r\n"
-     "Content-Type: text/html; charset=UTF-8\r\n"
-     "%s"
-     "\r\n",
-     errcode, errname, date, server_hdr, keep_alive(conn),
-     llu(conn->reply_length),
-     (auth_key != NULL ? auth_header : ""));
+    header_start(conn, errcode, errname);
+    header_literal(conn, "Accept-Ranges: bytes\r\n");
+    header_append(conn, keep_alive(conn));
+    header_literal(conn, "Content-Length: ");
+    header_number(conn, llu(conn->reply_length));
+    header_literal(conn, "\r\nContent-Type: text/html; charset=UTF-8\r\n");
+    if (auth_key != NULL)
+        header_literal(conn,
+            "WWW-Authenticate: Basic realm=\"User Visible Realm\"\r\n");
+    header_literal(conn, "\r\n");
 
     conn->reply_type = REPLY_GENERATED;
+    conn->reply_dont_free = 0;
     conn->http_code = errcode;
 
     /* Reset reply_start in case the request set a range. */
     conn->reply_start = 0;
+    conn->multipart = NULL;
 }
 
 static void redirect(struct connection *conn, const char *format, ...)
     __printflike(2, 3);
 static void redirect(struct connection *conn, const char *format, ...) {
-    char *where, date[DATE_LEN];
+    char *where;
     va_list va;
 
     va_start(va, format);
     xvasprintf(&where, format, va);
     va_end(va);
 
-    /* Only really need to calculate the date once. */
-    rfc1123_date(date, now);
-
     conn->reply_length = xasprintf(&(conn->reply),
      "<html><head><title>301 Moved Permanently</title></head><body>\n"
      "<h1>Moved Permanently</h1>\n"
@@ -1571,120 +2848,326 @@ static void redirect(struct connection *conn, const char *format, ...) {
      "<hr>\n"
      "%s" /* generated on */
      "</body></html>\n",
-     where, where, generated_on(date));
-
-    conn->header_length = xasprintf(&(conn->header),
-     "HTTP/1.1 301 Moved Permanently\r\n"
-     "Date: %s\r\n"
-     "%s" /* server */
-     /* "Accept-Ranges: bytes\r\n" - not relevant here */
-     "Location: %s\r\n"
-     "%s" /* keep-alive */
-     "Content-Length: %llu\r\n"
-     "Content-Type: text/html; charset=UTF-8\r\n"
-     "\r\n",
-     date, server_hdr, where, keep_alive(conn), llu(conn->reply_length));
+     where, where, generated_on(date_now()));
+
+    header_start(conn, 301, "Moved Permanently");
+    /* "Accept-Ranges: bytes\r\n" - not relevant here */
+    header_literal(conn, "Location: ");
+    header_append(conn, where);
+    header_literal(conn, "\r\n");
+    header_append(conn, keep_alive(conn));
+    header_literal(conn, "Content-Length: ");
+    header_number(conn, llu(conn->reply_length));
+    header_literal(conn, "\r\nContent-Type: text/html; charset=UTF-8\r\n"
+                         "\r\n");
 
     free(where);
     conn->reply_type = REPLY_GENERATED;
     conn->http_code = 301;
 }
 
-/* Parses a single HTTP request field.  Returns string from end of [field] to
- * first \r, \n or end of request string.  Returns NULL if [field] can't be
- * matched.
- *
- * You need to remember to deallocate the result.
- * example: parse_field(conn, "Referer: ");
+/* Return the first byte in [p, end) that is a, b or c, or end if there
+ * isn't one.  To look for fewer than three bytes, repeat one of them.
  */
-static char *parse_field(const struct connection *conn, const char *field) {
-    size_t bound1, bound2;
-    char *pos;
-
-    /* find start */
-    pos = strstr(conn->request, field);
-    if (pos == NULL)
-        return NULL;
-    assert(pos >= conn->request);
-    bound1 = (size_t)(pos - conn->request) + strlen(field);
-
-    /* find end */
-    for (bound2 = bound1;
-         ((bound2 < conn->request_length) &&
-          (conn->request[bound2] != '\r') &&
-          (conn->request[bound2] != '\n'));
-         bound2++)
-            ;
+static const char *find_delim_scalar(const char *p, const char *end,
+        const char a, const char b, const char c) {
+    for (; p < end; p++)
+        if (*p == a || *p == b || *p == c)
+            break;
+    return p;
+}
 
-    /* copy to buffer */
-    return split_string(conn->request, bound1, bound2);
+#ifdef HAVE_SSE2
+static const char *find_delim_sse2(const char *p, const char *end,
+        const char a, const char b, const char c) {
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b),
+                  vc = _mm_set1_epi8(c);
+
+    for (; end - p >= 16; p += 16) {
+        const __m128i x = _mm_loadu_si128((const __m128i *)p);
+        const unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, va),
+                                      _mm_cmpeq_epi8(x, vb)),
+                         _mm_cmpeq_epi8(x, vc)));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return find_delim_scalar(p, end, a, b, c);
 }
+#endif
 
-/* Parse a Range: field into range_begin and range_end.  Only handles the
- * first range if a list is given.  Sets range_{begin,end}_given to 1 if
- * either part of the range is given.
- */
-static void parse_range_field(struct connection *conn) {
-    char *range;
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *find_delim_avx2(const char *p, const char *end,
+        const char a, const char b, const char c) {
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b),
+                  vc = _mm256_set1_epi8(c);
+
+    for (; end - p >= 32; p += 32) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        const unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, va),
+                                            _mm256_cmpeq_epi8(x, vb)),
+                            _mm256_cmpeq_epi8(x, vc)));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    if (end - p >= 16) {
+        const __m128i x = _mm_loadu_si128((const __m128i *)p);
+        const unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_or_si128(_mm_or_si128(
+                _mm_cmpeq_epi8(x, _mm256_castsi256_si128(va)),
+                _mm_cmpeq_epi8(x, _mm256_castsi256_si128(vb))),
+                _mm_cmpeq_epi8(x, _mm256_castsi256_si128(vc))));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_delim_scalar(p, end, a, b, c);
+}
+#endif
 
-    range = parse_field(conn, "Range: bytes=");
-    if (range == NULL)
-        return;
+typedef const char *find_delim_fn(const char *, const char *,
+                                  const char, const char, const char);
+#ifdef HAVE_SSE2
+static find_delim_fn *find_delim = find_delim_sse2;
+#else
+static find_delim_fn *find_delim = find_delim_scalar;
+#endif
 
-    do {
-        size_t bound1, bound2, len;
-        len = strlen(range);
-
-        /* parse number up to hyphen */
-        bound1 = 0;
-        for (bound2=0;
-            (bound2 < len) && isdigit((int)range[bound2]);
-            bound2++)
-                ;
+/* Pick the fastest find_delim() this CPU can run.  Called once, before any
+ * threads start.
+ */
+static void init_find_delim(void) {
+#ifdef HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        find_delim = find_delim_avx2;
+#endif
+}
 
-        if ((bound2 == len) || (range[bound2] != '-'))
-            break; /* there must be a hyphen here */
+/* Names of the FIELD_* header fields, matched case-insensitively. */
+#define FIELD_NAME(name) { name, sizeof(name) - 1 }
+static const struct {
+    const char *name;
+    size_t length;
+} field_names[NUM_FIELDS] = {
+    FIELD_NAME("Accept-Encoding"),
+    FIELD_NAME("Authorization"),
+    FIELD_NAME("Connection"),
+    FIELD_NAME("Content-Length"),
+    FIELD_NAME("Host"),
+    FIELD_NAME("If-Modified-Since"),
+    FIELD_NAME("If-None-Match"),
+    FIELD_NAME("If-Range"),
+    FIELD_NAME("Range"),
+    FIELD_NAME("Referer"),
+    FIELD_NAME("Transfer-Encoding"),
+    FIELD_NAME("User-Agent"),
+};
+#undef FIELD_NAME
 
-        if (bound1 != bound2) {
-            conn->range_begin_given = 1;
-            conn->range_begin = (off_t)strtoll(range+bound1, NULL, 10);
+/* Go through the header lines after the request line once, and note where
+ * the value of each field we know about is.  If a field is given more than
+ * once, the first one counts.
+ */
+static void parse_headers(struct connection *conn) {
+    const char *r = conn->request, *end = r + conn->request_length;
+    const char *line = find_delim(r, end, '\n', '\n', '\n');
+
+    while (line < end && ++line < end) {
+        const char *colon = find_delim(line, end, ':', '\n', '\n');
+        const char *eol, *value, *value_end;
+        size_t name_length;
+        int i;
+
+        if (colon < end && *colon == ':') {
+            eol = find_delim(colon, end, '\n', '\n', '\n');
+            name_length = (size_t)(colon - line);
+            for (value = colon + 1;
+                 value < eol && (*value == ' ' || *value == '\t');
+                 value++)
+                    ;
+            for (value_end = eol;
+                 value_end > value && (value_end[-1] == '\r' ||
+                    value_end[-1] == ' ' || value_end[-1] == '\t');
+                 value_end--)
+                    ;
+            for (i = 0; i < NUM_FIELDS; i++)
+                if (field_names[i].length == name_length &&
+                        strncasecmp(field_names[i].name, line,
+                                    name_length) == 0) {
+                    if (conn->fields[i].start == 0) {
+                        conn->fields[i].start = (unsigned short)(value - r);
+                        conn->fields[i].length =
+                            (unsigned short)(value_end - value);
+                    }
+                    break;
+                }
         }
+        else
+            eol = colon;
+        line = eol;
+    }
+}
 
-        /* parse number after hyphen */
-        bound2++;
-        for (bound1=bound2;
-            (bound2 < len) && isdigit((int)range[bound2]);
-            bound2++)
-                ;
+/* Returns the value of a header field parsed by parse_headers(), allocated
+ * from the connection's arena, or NULL if the request didn't have it.
+ * example: parse_field(conn, FIELD_REFERER);
+ */
+static char *parse_field(struct connection *conn, const int field) {
+    if (conn->fields[field].start == 0)
+        return NULL;
+    return arena_strndup(&conn->arena,
+        conn->request + conn->fields[field].start,
+        conn->fields[field].length);
+}
+
+/* Content-Encodings for --precompressed sidecar files, and --compress, best
+ * first.
+ */
+enum { ENCODING_BR, ENCODING_ZSTD, ENCODING_GZIP };
+static const struct {
+    const char *name, *ext;
+} encodings[] = {
+    { "br",   ".br"  },
+    { "zstd", ".zst" },
+    { "gzip", ".gz"  },
+};
+#define NUM_ENCODINGS (sizeof(encodings) / sizeof(*encodings))
+#define MAX_ENCODING_EXT 4 /* strlen(".zst") */
+
+/* Returns a bitmask of the encodings[] that the Accept-Encoding field allows.
+ * An encoding is out if it's given with q=0, or if it's not listed and
+ * neither is "*".  Otherwise the client doesn't get a say in which one.
+ */
+static unsigned int accepted_encodings(struct connection *conn) {
+    const char *p = parse_field(conn, FIELD_ACCEPT_ENCODING);
+    unsigned int listed = 0, refused = 0;
+    int star = 0;
+
+    if (p == NULL)
+        return 0;
+    while (*p != '\0') {
+        const char *token, *token_end;
+        int zero = 0;
+        size_t i, len;
+
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        token = p;
+        while (*p != '\0' && *p != ',' && *p != ';' &&
+               *p != ' ' && *p != '\t')
+            p++;
+        token_end = p;
+        /* parameters: only q matters */
+        for (; *p != '\0' && *p != ','; p++)
+            if (*p == '=' && p > token_end &&
+                    (p[-1] == 'q' || p[-1] == 'Q')) {
+                const char *q = p + 1;
+
+                zero = 0;
+                if (*q == '0') { /* (q= can be the end of the field) */
+                    if (*++q == '.')
+                        q += 1 + strspn(q + 1, "0");
+                    zero = !isdigit((unsigned char)*q);
+                }
+            }
 
-        if ((bound2 != len) && (range[bound2] != ','))
-            break; /* must be end of string or a list to be valid */
+        len = (size_t)(token_end - token);
+        if (len == 1 && *token == '*') {
+            star = !zero;
+            continue;
+        }
+        if (len == 6 && strncasecmp(token, "x-gzip", 6) == 0) {
+            token += 2;
+            len -= 2;
+        }
+        for (i = 0; i < NUM_ENCODINGS; i++)
+            if (strlen(encodings[i].name) == len &&
+                    strncasecmp(encodings[i].name, token, len) == 0) {
+                listed |= 1u << i;
+                if (zero)
+                    refused |= 1u << i;
+            }
+    }
+    return (star ? ~0u : listed) & ~refused & ((1u << NUM_ENCODINGS) - 1);
+}
+
+/* Parse a Range: field into ranges[], with -1 for a bound that isn't given,
+ * and the first range into range_begin and range_end, setting
+ * range_{begin,end}_given to 1 if either part of it is given.  If any of the
+ * list doesn't parse, or there are more than MAX_RANGES, none of it counts.
+ */
+static void parse_range_field(struct connection *conn) {
+    const char *p = parse_field(conn, FIELD_RANGE);
+    struct byterange *r;
+    char *end;
+    size_t n = 0;
 
-        if (bound1 != bound2) {
-            conn->range_end_given = 1;
-            conn->range_end = (off_t)strtoll(range+bound1, NULL, 10);
+    if (p == NULL || strncasecmp(p, "bytes=", 6) != 0)
+        return;
+    p += 6;
+
+    for (;;) {
+        if (n == MAX_RANGES)
+            return;
+        r = &conn->ranges[n];
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        /* number up to hyphen */
+        r->from = r->to = -1;
+        if (isdigit((int)*p)) {
+            r->from = (off_t)strtoll(p, &end, 10);
+            p = end;
         }
-    } while(0);
-    free(range);
+        if (*p++ != '-')
+            return; /* there must be a hyphen here */
+
+        /* number after hyphen */
+        if (isdigit((int)*p)) {
+            r->to = (off_t)strtoll(p, &end, 10);
+            p = end;
+        }
+        if (r->from == -1 && r->to == -1)
+            return;
+        n++;
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0')
+            break;
+        if (*p++ != ',')
+            return; /* must be end of string or a list to be valid */
+    }
+
+    conn->num_ranges = n;
+    if (conn->ranges[0].from != -1) {
+        conn->range_begin_given = 1;
+        conn->range_begin = conn->ranges[0].from;
+    }
+    if (conn->ranges[0].to != -1) {
+        conn->range_end_given = 1;
+        conn->range_end = conn->ranges[0].to;
+    }
 }
 
 /* Parse an HTTP request like "GET / HTTP/1.1" to get the method (GET), the
- * url (/), the referer (if given) and the user-agent (if given).  Remember to
- * deallocate all these buffers.  The method will be returned in uppercase.
+ * url (/), the referer (if given) and the user-agent (if given).  These are
+ * allocated from the connection's arena.  The method will be returned in
+ * uppercase.
  */
 static int parse_request(struct connection *conn) {
+    const char *r = conn->request, *end = r + conn->request_length;
     size_t bound1, bound2;
     char *tmp;
     assert(conn->request_length == strlen(conn->request));
 
     /* parse method */
-    for (bound1 = 0;
-        (bound1 < conn->request_length) &&
-        (conn->request[bound1] != ' ');
-        bound1++)
-            ;
+    bound1 = (size_t)(find_delim(r, end, ' ', ' ', ' ') - r);
 
-    conn->method = split_string(conn->request, 0, bound1);
+    conn->method = arena_strndup(&conn->arena, conn->request, bound1);
     strntoupper(conn->method, bound1);
 
     /* parse url */
@@ -1697,15 +3180,10 @@ static int parse_request(struct connection *conn) {
     if (bound1 == conn->request_length)
         return 0; /* fail */
 
-    for (bound2 = bound1 + 1;
-        (bound2 < conn->request_length) &&
-        (conn->request[bound2] != ' ') &&
-        (conn->request[bound2] != '\r') &&
-        (conn->request[bound2] != '\n');
-        bound2++)
-            ;
+    bound2 = (size_t)(find_delim(r + bound1 + 1, end, ' ', '\r', '\n') - r);
 
-    conn->url = split_string(conn->request, bound1, bound2);
+    conn->url = arena_strndup(&conn->arena, conn->request + bound1,
+        bound2 - bound1);
 
     /* parse protocol to determine conn_close */
     if (conn->request[bound2] == ' ') {
@@ -1716,27 +3194,35 @@ static int parse_request(struct connection *conn) {
             bound1++)
                 ;
 
-        for (bound2 = bound1 + 1;
-            (bound2 < conn->request_length) &&
-            (conn->request[bound2] != ' ') &&
-            (conn->request[bound2] != '\r');
-            bound2++)
-                ;
+        bound2 = (size_t)(find_delim(r + bound1 + 1, end,
+            ' ', '\r', '\r') - r);
 
-        proto = split_string(conn->request, bound1, bound2);
+        proto = arena_strndup(&conn->arena, conn->request + bound1,
+            bound2 - bound1);
         if (strcasecmp(proto, "HTTP/1.1") == 0)
             conn->conn_close = 0;
-        free(proto);
     }
 
+    parse_headers(conn);
+
     /* parse connection field */
-    tmp = parse_field(conn, "Connection: ");
+    tmp = parse_field(conn, FIELD_CONNECTION);
     if (tmp != NULL) {
         if (strcasecmp(tmp, "close") == 0)
             conn->conn_close = 1;
         else if (strcasecmp(tmp, "keep-alive") == 0)
             conn->conn_close = 0;
-        free(tmp);
+    }
+
+    /* We don't read request bodies, so we'd lose track of where the next
+     * request starts after one.
+     */
+    tmp = parse_field(conn, FIELD_CONTENT_LENGTH);
+    if ((tmp != NULL && strtoll(tmp, NULL, 10) != 0) ||
+            conn->fields[FIELD_TRANSFER_ENCODING].start != 0) {
+        conn->conn_close = 1;
+        conn->pipelined = 0;
+        discard_input(conn);
     }
 
     /* cmdline flag can be used to deny keep-alive */
@@ -1744,9 +3230,9 @@ static int parse_request(struct connection *conn) {
         conn->conn_close = 1;
 
     /* parse important fields */
-    conn->referer = parse_field(conn, "Referer: ");
-    conn->user_agent = parse_field(conn, "User-Agent: ");
-    conn->authorization = parse_field(conn, "Authorization: ");
+    conn->referer = parse_field(conn, FIELD_REFERER);
+    conn->user_agent = parse_field(conn, FIELD_USER_AGENT);
+    conn->authorization = parse_field(conn, FIELD_AUTHORIZATION);
     parse_range_field(conn);
     return 1;
 }
@@ -1861,13 +3347,28 @@ static void urlencode(const char *src, char *dest) {
     dest[j] = '\0';
 }
 
+/* Content-Encoding and Vary for a reply that might have been compressed,
+ * see open_precompressed() and --compress.
+ */
+static void header_encoding(struct connection *conn, const char *encoding) {
+    if (encoding != NULL) {
+        header_literal(conn, "Content-Encoding: ");
+        header_append(conn, encoding);
+        header_literal(conn, "\r\n");
+    }
+    if (want_precompressed || want_compress)
+        header_literal(conn, "Vary: Accept-Encoding\r\n");
+}
+
 static void generate_dir_listing(struct connection *conn, const char *path) {
-    char date[DATE_LEN], *spaces;
+    char *spaces;
     struct dlent **list;
     ssize_t listsize;
     size_t maxlen = 2; /* There has to be ".." */
     int i;
     struct apbuf *listing;
+    size_t stable_length;
+    const char *encoding = NULL;
 
     listsize = make_sorted_dirlist(path, &list);
     if (listsize == -1) {
@@ -1924,655 +3425,3528 @@ static void generate_dir_listing(struct connection *conn, const char *path) {
     append(listing,
      "</pre></tt>\n"
      "<hr>\n");
+    stable_length = listing->length;
 
-    rfc1123_date(date, now);
-    append(listing, generated_on(date));
+    append(listing, generated_on(date_now()));
     append(listing, "</body>\n</html>\n");
 
     conn->reply = listing->str;
     conn->reply_length = (off_t)listing->length;
     free(listing); /* don't free inside of listing */
 
-    conn->header_length = xasprintf(&(conn->header),
-     "HTTP/1.1 200 OK\r\n"
-     "Date: %s\r\n"
-     "%s" /* server */
-     "Accept-Ranges: bytes\r\n"
-     "%s" /* keep-alive */
-     "Content-Length: %llu\r\n"
-     "Content-Type: text/html; charset=UTF-8\r\n"
-     "\r\n",
-     date, server_hdr, keep_alive(conn), llu(conn->reply_length));
+#ifdef HAVE_COMPRESS
+    if (want_compress)
+        encoding = compress_listing(conn, path, stable_length);
+#else
+    (void)stable_length;
+#endif
+
+    header_start(conn, 200, "OK");
+    header_literal(conn, "Accept-Ranges: bytes\r\n");
+    header_append(conn, keep_alive(conn));
+    header_encoding(conn, encoding);
+    header_literal(conn, "Content-Length: ");
+    header_number(conn, llu(conn->reply_length));
+    header_literal(conn, "\r\nContent-Type: text/html; charset=UTF-8\r\n"
+                         "\r\n");
 
     conn->reply_type = REPLY_GENERATED;
     conn->http_code = 200;
 }
 
-/* Process a GET/HEAD request. */
-static void process_get(struct connection *conn) {
-    char *decoded_url, *end, *target, *if_mod_since;
-    char date[DATE_LEN], lastmod[DATE_LEN];
-    const char *mimetype = NULL;
-    const char *forward_to = NULL;
-    struct stat filestat;
+/* --cache-size and --fd-cache: each event loop keeps the files it serves
+ * most, along with the end of their 200 response header.  Small ones are
+ * kept in memory, so that serving one doesn't touch the file at all, and
+ * others are kept open, which saves the open() and fstat().  Filling happens
+ * right there in the loop, so a burst of requests for the same file only
+ * opens it once.
+ *
+ * Entries are dropped as soon as inotify says the file, or a directory on
+ * the way to it, has changed.  Without inotify, or for a file reached
+ * through a symlink or with other hard links, they're checked against
+ * stat() every cache_ttl seconds.
+ *
+ * --compress puts compressed copies in here too, under the same path with
+ * a different encoding.  They remember the size and mtime of what they were
+ * made from (or a hash of it, for a generated reply), and only count if that
+ * still matches.
+ */
+struct file_cache_entry {
+    struct file_cache_entry *hash_next;
+    struct file_cache_entry *lru_prev, *lru_next; /* most recent first */
+    unsigned int hash;
+    int refs;           /* one while cached, plus one per connection */
+    time_t checked;     /* when it was last compared with the file */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime, ctime;
+    char lastmod[DATE_LEN];
+    char etag[ETAG_LEN];
+    char *header;       /* from Content-Length on, for a 200 */
+    size_t header_length;
+    size_t mem;         /* what it counts against file_cache_size */
+    int fd;             /* kept open, or -1 if data is kept instead */
+    int wd;             /* inotify watch on its directory, or -1 */
+    char *data;         /* NULL in a compressed copy that wasn't worth it */
+    int encoding;       /* 0, or 1 + ENCODING_* for a compressed copy */
+    off_t source_size;  /* for a compressed copy: what it was made from */
+    uint64_t source_version;
+    char path[];        /* the key, with encoding; header and data follow */
+};
 
-    /* strip out query params */
-    if ((end = strchr(conn->url, '?')) != NULL)
-        *end = '\0';
+/* A watched directory.  It's held by each entry directly inside it and each
+ * watched directory directly below it, and unwatched when the last of those
+ * goes.  dir is NULL once it no longer names the directory (or the slot is
+ * free).
+ */
+struct file_cache_watch {
+    char *dir;
+    int refs;
+    int parent;         /* watch descriptor of the directory above, or -1 */
+};
 
-    /* work out path of file being requested */
-    decoded_url = urldecode(conn->url);
+static per_loop struct {
+    struct file_cache_entry **buckets;
+    size_t num_buckets, count, mem, fds;
+    struct file_cache_entry *lru_head, *lru_tail;
+    int notify_fd;      /* inotify, or -1 to check every cache_ttl */
+    struct file_cache_watch *watches; /* by watch descriptor */
+    size_t num_watches;
+    int out_of_watches; /* and we've said so */
+} file_cache = { .notify_fd = -1 };
+
+/* FNV-1a */
+static unsigned int file_cache_hash(const char *path, const int encoding) {
+    unsigned int hash = 2166136261u;
+
+    for (; *path != '\0'; path++)
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    return (hash ^ (unsigned int)encoding) * 16777619u;
+}
 
-    /* make sure it's safe */
-    if (make_safe_url(decoded_url) == NULL) {
-        default_reply(conn, 400, "Bad Request",
-                      "You requested an invalid URL: %s", conn->url);
-        free(decoded_url);
-        return;
+static void file_cache_unref(struct file_cache_entry *e) {
+    if (--e->refs == 0) {
+        if (e->fd != -1)
+            xclose(e->fd);
+        free(e);
     }
+}
 
-    /* test the host against web forward options */
-    if (forward_map) {
-        char *host = parse_field(conn, "Host: ");
-        if (host) {
-            size_t i;
-            if (debug)
-                printf("host=\"%s\"\n", host);
-            for (i = 0; i < forward_map_size; i++) {
-                if (strcasecmp(forward_map[i].host, host) == 0) {
-                    forward_to = forward_map[i].target_url;
-                    break;
-                }
-            }
-            free(host);
-        }
-    }
-    if (!forward_to) {
-        forward_to = forward_all_url;
-    }
-    if (forward_to) {
-        redirect(conn, "%s%s", forward_to, decoded_url);
-        free(decoded_url);
-        return;
-    }
+static void file_cache_lru_remove(struct file_cache_entry *e) {
+    if (e->lru_prev != NULL)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        file_cache.lru_head = e->lru_next;
+    if (e->lru_next != NULL)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        file_cache.lru_tail = e->lru_prev;
+}
 
-    /* does it end in a slash? serve up url/index_name */
-    if (decoded_url[strlen(decoded_url)-1] == '/') {
-        xasprintf(&target, "%s%s%s", wwwroot, decoded_url, index_name);
-        if (!file_exists(target)) {
-            free(target);
-            if (no_listing) {
-                free(decoded_url);
-                /* Return 404 instead of 403 to make --no-listing
-                 * indistinguishable from the directory not existing.
-                 * i.e.: Don't leak information.
-                 */
-                default_reply(conn, 404, "Not Found",
-                    "The URL you requested (%s) was not found.", conn->url);
-                return;
-            }
-            xasprintf(&target, "%s%s", wwwroot, decoded_url);
-            generate_dir_listing(conn, target);
-            free(target);
-            free(decoded_url);
-            return;
-        }
-        mimetype = url_content_type(index_name);
-    }
-    else {
-        /* points to a file */
-        xasprintf(&target, "%s%s", wwwroot, decoded_url);
-        mimetype = url_content_type(decoded_url);
-    }
-    free(decoded_url);
-    if (debug)
-        printf("url=\"%s\", target=\"%s\", content-type=\"%s\"\n",
-               conn->url, target, mimetype);
+static void file_cache_lru_push(struct file_cache_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = file_cache.lru_head;
+    if (file_cache.lru_head != NULL)
+        file_cache.lru_head->lru_prev = e;
+    else
+        file_cache.lru_tail = e;
+    file_cache.lru_head = e;
+}
 
-    /* open file */
-    conn->reply_fd = open(target, O_RDONLY | O_NONBLOCK);
-    free(target);
+/* Take an entry out of the cache.  Connections still sending it keep it
+ * alive until they're done.
+ */
+static void file_cache_remove(struct file_cache_entry *e) {
+    struct file_cache_entry **p =
+        &file_cache.buckets[e->hash & (file_cache.num_buckets - 1)];
+
+    while (*p != e)
+        p = &(*p)->hash_next;
+    *p = e->hash_next;
+    file_cache_lru_remove(e);
+    file_cache.count--;
+    file_cache.mem -= e->mem;
+    if (e->fd != -1)
+        file_cache.fds--;
+#ifdef HAVE_INOTIFY
+    if (e->wd != -1)
+        file_cache_unwatch(e->wd);
+#endif
+    file_cache_unref(e);
+}
 
-    if (conn->reply_fd == -1) {
-        /* open() failed */
-        if (errno == EACCES)
-            default_reply(conn, 403, "Forbidden",
-                "You don't have permission to access (%s).", conn->url);
-        else if (errno == ENOENT)
-            default_reply(conn, 404, "Not Found",
-                "The URL you requested (%s) was not found.", conn->url);
-        else
-            default_reply(conn, 500, "Internal Server Error",
-                "The URL you requested (%s) cannot be returned: %s.",
-                conn->url, strerror(errno));
+/* Throw out the least recently used entry that keeps an fd open (or that
+ * keeps data, if has_fd is 0) to make room for a new one.
+ */
+static void file_cache_evict(const int has_fd) {
+    struct file_cache_entry *e = file_cache.lru_tail;
 
-        return;
-    }
+    while ((e->fd != -1) != has_fd)
+        e = e->lru_prev;
+    file_cache_remove(e);
+    file_cache_evictions++;
+}
 
-    /* stat the file */
-    if (fstat(conn->reply_fd, &filestat) == -1) {
-        default_reply(conn, 500, "Internal Server Error",
-            "fstat() failed: %s.", strerror(errno));
-        return;
+/* Double the hash table, or make the first one. */
+static void file_cache_grow(void) {
+    const size_t num_buckets =
+        file_cache.num_buckets ? file_cache.num_buckets * 2 : 64;
+    struct file_cache_entry **buckets =
+        xmalloc(sizeof(*buckets) * num_buckets);
+    struct file_cache_entry *e;
+
+    memset(buckets, 0, sizeof(*buckets) * num_buckets);
+    for (e = file_cache.lru_head; e != NULL; e = e->lru_next) {
+        e->hash_next = buckets[e->hash & (num_buckets - 1)];
+        buckets[e->hash & (num_buckets - 1)] = e;
     }
+    free(file_cache.buckets);
+    file_cache.buckets = buckets;
+    file_cache.num_buckets = num_buckets;
+}
 
-    /* make sure it's a regular file */
-    if (S_ISDIR(filestat.st_mode)) {
-        redirect(conn, "%s/", conn->url);
-        return;
-    }
-    else if (!S_ISREG(filestat.st_mode)) {
-        default_reply(conn, 403, "Forbidden", "Not a regular file.");
-        return;
-    }
+static struct file_cache_entry *file_cache_find(const char *path,
+        const int encoding) {
+    struct file_cache_entry *e;
+    unsigned int hash;
 
-    conn->reply_type = REPLY_FROMFILE;
-    rfc1123_date(lastmod, filestat.st_mtime);
+    if (file_cache.count == 0)
+        return NULL;
+    hash = file_cache_hash(path, encoding);
+    for (e = file_cache.buckets[hash & (file_cache.num_buckets - 1)];
+         e != NULL; e = e->hash_next)
+        if (e->hash == hash && e->encoding == encoding &&
+                strcmp(e->path, path) == 0)
+            return e;
+    return NULL;
+}
 
-    /* check for If-Modified-Since, may not have to send */
-    if_mod_since = parse_field(conn, "If-Modified-Since: ");
-    if ((if_mod_since != NULL) &&
-            (strcmp(if_mod_since, lastmod) == 0)) {
-        if (debug)
-            printf("not modified since %s\n", if_mod_since);
-        conn->http_code = 304;
-        conn->header_length = xasprintf(&(conn->header),
-         "HTTP/1.1 304 Not Modified\r\n"
-         "Date: %s\r\n"
-         "%s" /* server */
-         "Accept-Ranges: bytes\r\n"
-         "%s" /* keep-alive */
-         "\r\n",
-         rfc1123_date(date, now), server_hdr, keep_alive(conn));
-        conn->reply_length = 0;
-        conn->reply_type = REPLY_GENERATED;
-        conn->header_only = 1;
+/* Move an entry that's been used to the front of the LRU list. */
+static void file_cache_touch(struct file_cache_entry *e) {
+    if (e != file_cache.lru_head) {
+        file_cache_lru_remove(e);
+        file_cache_lru_push(e);
+    }
+}
 
-        free(if_mod_since);
-        return;
+/* Returns the cached copy of the file at path, or NULL if there isn't one
+ * or the file has changed since.
+ */
+static struct file_cache_entry *file_cache_lookup(const char *path) {
+    struct file_cache_entry *e;
+
+    if (file_cache_size == 0 && fd_cache_max == 0)
+        return NULL;
+    e = file_cache_find(path, 0);
+    /* (entries that inotify isn't watching have no wd) */
+    if (e != NULL && e->wd == -1 && now - e->checked >= cache_ttl) {
+        struct stat st;
+
+        if (stat(path, &st) == -1 || !S_ISREG(st.st_mode) ||
+                st.st_dev != e->dev || st.st_ino != e->ino ||
+                st.st_size != e->size || st.st_mtime != e->mtime ||
+                st.st_ctime != e->ctime) {
+            file_cache_remove(e);
+            e = NULL;
+        }
+        else
+            e->checked = now;
+    }
+    if (e == NULL) {
+        file_cache_misses++;
+        return NULL;
     }
-    free(if_mod_since);
+    file_cache_hits++;
+    file_cache_touch(e);
+    return e;
+}
 
-    if (conn->range_begin_given || conn->range_end_given) {
-        off_t from, to;
+#ifdef HAVE_INOTIFY
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_MOVED_FROM | \
+                    IN_MOVED_TO | IN_DELETE | IN_DELETE_SELF | \
+                    IN_MOVE_SELF | IN_ONLYDIR)
 
-        if (conn->range_begin_given && conn->range_end_given) {
-            /* 100-200 */
-            from = conn->range_begin;
-            to = conn->range_end;
+/* Let go of a watch, and of the ones above it that nothing else needs. */
+static void file_cache_unwatch(int wd) {
+    while (wd != -1 && --file_cache.watches[wd].refs == 0) {
+        struct file_cache_watch *w = &file_cache.watches[wd];
 
-            /* clamp end to filestat.st_size-1 */
-            if (to > (filestat.st_size - 1))
-                to = filestat.st_size - 1;
-        }
-        else if (conn->range_begin_given && !conn->range_end_given) {
-            /* 100- :: yields 100 to end */
-            from = conn->range_begin;
-            to = filestat.st_size - 1;
+        if (w->dir != NULL) {
+            inotify_rm_watch(file_cache.notify_fd, wd);
+            free(w->dir);
+            w->dir = NULL;
         }
-        else if (!conn->range_begin_given && conn->range_end_given) {
-            /* -200 :: yields last 200 */
-            to = filestat.st_size - 1;
-            from = to - conn->range_end + 1;
+        wd = w->parent;
+    }
+}
 
-            /* clamp start */
-            if (from < 0)
-                from = 0;
+/* Watch every directory from the one holding path up to wwwroot, since a
+ * rename anywhere along the way changes what path is.  Returns the watch
+ * on the one holding path, with a reference for the caller, or -1 if we've
+ * run out of watches.
+ */
+static int file_cache_watch(const char *path) {
+    const size_t root_len = strlen(wwwroot);
+    char *dir = xstrdup(path), *slash;
+    int wd, leaf = -1, child = -1;
+
+    while ((slash = strrchr(dir, '/')) != NULL &&
+            (size_t)(slash - dir) >= root_len) {
+        struct file_cache_watch *w;
+
+        *slash = '\0';
+        wd = inotify_add_watch(file_cache.notify_fd,
+            (dir[0] != '\0') ? dir : "/", WATCH_MASK);
+        if (wd == -1) {
+            if (!file_cache.out_of_watches) {
+                warn("inotify_add_watch(%s), not caching any more "
+                     "directories", dir);
+                file_cache.out_of_watches = 1;
+            }
+            free(dir);
+            if (leaf != -1)
+                file_cache_unwatch(leaf);
+            return -1;
         }
+        if ((size_t)wd >= file_cache.num_watches) {
+            const size_t n = (size_t)wd * 2 + 16;
+
+            file_cache.watches = xrealloc(file_cache.watches,
+                n * sizeof(*file_cache.watches));
+            memset(file_cache.watches + file_cache.num_watches, 0,
+                (n - file_cache.num_watches) * sizeof(*file_cache.watches));
+            file_cache.num_watches = n;
+        }
+        w = &file_cache.watches[wd];
+        if (wd == child)
+            break; /* a symlink to its own directory */
+        if (leaf == -1)
+            leaf = wd;
         else
-            errx(1, "internal error - from/to mismatch");
+            file_cache.watches[child].parent = wd;
+        w->refs++;
+        if (w->dir != NULL)
+            break; /* already watched, and so is everything above it */
+        w->dir = xstrdup(dir);
+        w->parent = -1;
+        child = wd;
+    }
+    free(dir);
+    return leaf;
+}
 
-        if (from >= filestat.st_size) {
-            default_reply(conn, 416, "Requested Range Not Satisfiable",
-                "You requested a range outside of the file.");
-            return;
-        }
+/* Returns 1 if a change to the file at path would be seen by watching the
+ * directories on the way to it: not if it, or any of them below wwwroot, is
+ * a symlink, or if the file has other hard links.  Those could change
+ * through some other path.
+ */
+static int file_cache_watchable(const char *path, const struct stat *st) {
+    const size_t root_len = strlen(wwwroot);
+    char *p = xstrdup(path), *slash = p + root_len;
+    struct stat lst;
+    int ok = (st->st_nlink <= 1);
+
+    while (ok && slash != NULL) {
+        slash = strchr(slash + 1, '/');
+        if (slash != NULL)
+            *slash = '\0';
+        ok = (lstat(p, &lst) == 0 && !S_ISLNK(lst.st_mode));
+        if (slash != NULL)
+            *slash = '/';
+    }
+    free(p);
+    return ok;
+}
 
-        if (to < from) {
-            default_reply(conn, 416, "Requested Range Not Satisfiable",
-                "You requested a backward range.");
-            return;
+/* Drop everything under the directory dir. */
+static void file_cache_drop_dir(const char *dir) {
+    const size_t len = strlen(dir);
+    struct file_cache_entry *e, *next;
+
+    for (e = file_cache.lru_head; e != NULL; e = next) {
+        next = e->lru_next;
+        if (strncmp(e->path, dir, len) == 0 && e->path[len] == '/')
+            file_cache_remove(e);
+    }
+}
+
+/* Drop whatever inotify says has changed. */
+static void file_cache_notify(void) {
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p, *dir, *path;
+
+    while ((len = read(file_cache.notify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                /* Missed some, so nothing can be trusted. */
+                file_cache_drop_dir(wwwroot);
+                continue;
+            }
+            if (ev->wd < 0 || (size_t)ev->wd >= file_cache.num_watches ||
+                    (dir = file_cache.watches[ev->wd].dir) == NULL)
+                continue;
+            if (debug)
+                printf("inotify: %s/%s mask 0x%x\n", dir,
+                       ev->len ? ev->name : "", ev->mask);
+            if (ev->len == 0) {
+                /* Something happened to the directory itself. */
+                file_cache_drop_dir(dir);
+                if ((ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                        && file_cache.watches[ev->wd].dir != NULL) {
+                    /* It's not at dir any more, but something still holds
+                     * the watch: going by the same name, through a symlink.
+                     */
+                    inotify_rm_watch(file_cache.notify_fd, ev->wd);
+                    free(dir);
+                    file_cache.watches[ev->wd].dir = NULL;
+                }
+                continue;
+            }
+            /* Without IN_ISDIR it could still be a symlink to a directory,
+             * swapped in for another one, so drop both.
+             */
+            xasprintf(&path, "%s/%s", dir, ev->name);
+            file_cache_drop_dir(path);
+            {
+                struct file_cache_entry *e;
+                int encoding;
+
+                /* and any compressed copies */
+                for (encoding = 0; encoding <= (int)NUM_ENCODINGS;
+                     encoding++)
+                    if ((e = file_cache_find(path, encoding)) != NULL)
+                        file_cache_remove(e);
+            }
+            free(path);
         }
+    }
+    if (len == -1 && errno != EAGAIN)
+        err(1, "read(inotify)");
+}
+#endif
 
-        conn->reply_start = from;
-        conn->reply_length = to - from + 1;
+/* See to any changes inotify knows about, before serving something that the
+ * poller hasn't been back to ask about.
+ */
+static void file_cache_catch_up(void) {
+#ifdef HAVE_INOTIFY
+    if (file_cache.notify_fd != -1)
+        file_cache_notify();
+#endif
+}
 
-        conn->header_length = xasprintf(&(conn->header),
-            "HTTP/1.1 206 Partial Content\r\n"
-            "Date: %s\r\n"
-            "%s" /* server */
-            "Accept-Ranges: bytes\r\n"
-            "%s" /* keep-alive */
-            "Content-Length: %llu\r\n"
-            "Content-Range: bytes %llu-%llu/%llu\r\n"
-            "Content-Type: %s\r\n"
-            "Last-Modified: %s\r\n"
-            "\r\n"
-            ,
-            rfc1123_date(date, now), server_hdr, keep_alive(conn),
-            llu(conn->reply_length), llu(from), llu(to),
-            llu(filestat.st_size), mimetype, lastmod
-        );
-        conn->http_code = 206;
-        if (debug)
-            printf("sending %llu-%llu/%llu\n",
-                   llu(from), llu(to), llu(filestat.st_size));
+/* Add a new entry, with its hash, fd, mem and encoding filled in, making room
+ * by throwing out the least recently used ones.
+ */
+static void file_cache_insert(struct file_cache_entry *e) {
+    if (e->fd != -1) {
+        while (file_cache.fds >= fd_cache_max)
+            file_cache_evict(1);
+        file_cache.fds++;
     }
-    else {
-        /* no range stuff */
-        conn->reply_length = filestat.st_size;
-        conn->header_length = xasprintf(&(conn->header),
-            "HTTP/1.1 200 OK\r\n"
-            "Date: %s\r\n"
-            "%s" /* server */
-            "Accept-Ranges: bytes\r\n"
-            "%s" /* keep-alive */
-            "Content-Length: %llu\r\n"
-            "Content-Type: %s\r\n"
-            "Last-Modified: %s\r\n"
-            "\r\n"
-            ,
-            rfc1123_date(date, now), server_hdr, keep_alive(conn),
-            llu(conn->reply_length), mimetype, lastmod
-        );
-        conn->http_code = 200;
+    while (file_cache.mem + e->mem > file_cache_size)
+        file_cache_evict(0);
+    if (file_cache.count >= file_cache.num_buckets)
+        file_cache_grow();
+    e->hash_next = file_cache.buckets[e->hash & (file_cache.num_buckets - 1)];
+    file_cache.buckets[e->hash & (file_cache.num_buckets - 1)] = e;
+    file_cache_lru_push(e);
+    file_cache.count++;
+    file_cache.mem += e->mem;
+}
+
+/* Returns 1 if we'd find out about the file at path changing from what's in
+ * st, which was fstat()ed from its open fd, from now on.  With inotify, *wd
+ * is set to the watch that an entry for it holds; otherwise it's -1 and the
+ * entry gets checked with stat() every cache_ttl seconds.
+ */
+static int file_cache_trust(const char *path, const struct stat *st,
+        int *wd) {
+    *wd = -1;
+#ifdef HAVE_INOTIFY
+    if (file_cache.notify_fd != -1 && file_cache_watchable(path, st)) {
+        struct stat again;
+
+        if ((*wd = file_cache_watch(path)) == -1)
+            return 0;
+        /* Anything that happened before the watches were in place would
+         * go unnoticed, so look again after.
+         */
+        if (stat(path, &again) == 0 &&
+                again.st_dev == st->st_dev && again.st_ino == st->st_ino &&
+                again.st_ctim.tv_sec == st->st_ctim.tv_sec &&
+                again.st_ctim.tv_nsec == st->st_ctim.tv_nsec)
+            return 1;
+        file_cache_unwatch(*wd);
+        *wd = -1;
+        return 0;
     }
+#endif
+    (void)path;
+    /* Another change in the same second as the last one wouldn't change
+     * the ctime, so stat() would never show it.
+     */
+    return st->st_ctime < now;
 }
 
-/* Process a request: build the header and reply, advance state. */
-static void process_request(struct connection *conn) {
-    num_requests++;
+/* Put the file open on fd in the cache, making room by throwing out the
+ * least recently used entries.  It's read into memory if it's small enough,
+ * otherwise the entry takes fd over and keeps it open.  Returns NULL if it
+ * can't be cached, or can't be read.
+ */
+static struct file_cache_entry *file_cache_fill(const char *path,
+        const int fd, const struct stat *st, const char *lastmod) {
+    const size_t path_len = strlen(path);
+    struct file_cache_entry *e;
+    char *header;
+    size_t header_length, size = 0, mem, done;
+    int keep_fd = 0, wd;
+    ssize_t got;
+    char etag[ETAG_LEN];
+
+    make_etag(etag, st);
+    header_length = xasprintf(&header,
+        "Content-Length: %llu\r\n"
+        "Last-Modified: %s\r\n"
+        "ETag: %s\r\n"
+        "\r\n",
+        llu(st->st_size), lastmod, etag);
+    mem = sizeof(*e) + path_len + 1 + header_length;
+    if (file_cache_size > 0 && st->st_size <= (off_t)file_cache_max_file &&
+            mem + (size_t)st->st_size <= file_cache_size)
+        size = (size_t)st->st_size;
+    else if (fd_cache_max > 0)
+        keep_fd = 1;
+    else {
+        free(header);
+        return NULL;
+    }
+    if (!file_cache_trust(path, st, &wd)) {
+        free(header);
+        return NULL;
+    }
 
-    if (!parse_request(conn)) {
-        default_reply(conn, 400, "Bad Request",
-            "You sent a request that the server couldn't understand.");
+    e = xmalloc(mem + size);
+    e->header = e->path + path_len + 1;
+    e->data = keep_fd ? NULL : e->header + header_length;
+    for (done = 0; done < size; done += (size_t)got) {
+        got = pread(fd, e->data + done, size - done, (off_t)done);
+        if (got <= 0) {
+            free(header);
+            free(e);
+#ifdef HAVE_INOTIFY
+            if (wd != -1)
+                file_cache_unwatch(wd);
+#endif
+            return NULL;
+        }
     }
-    /* fail if: (auth_enabled) AND (client supplied invalid credentials) */
-    else if (auth_key != NULL &&
-            (conn->authorization == NULL ||
-             strcmp(conn->authorization, auth_key)))
-    {
-        default_reply(conn, 401, "Unauthorized",
-            "Access denied due to invalid credentials.");
+    memcpy(e->path, path, path_len + 1);
+    memcpy(e->header, header, header_length);
+    free(header);
+    e->header_length = header_length;
+    e->hash = file_cache_hash(path, 0);
+    e->refs = 1;
+    e->checked = now;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->ctime = st->st_ctime;
+    memcpy(e->lastmod, lastmod, DATE_LEN);
+    memcpy(e->etag, etag, ETAG_LEN);
+    e->fd = keep_fd ? fd : -1;
+    e->wd = wd;
+    e->mem = keep_fd ? 0 : mem + size;
+    e->encoding = 0;
+    file_cache_insert(e);
+    return e;
+}
+
+/* Empty the cache at the end of the event loop. */
+static void file_cache_destroy(void) {
+    size_t i;
+
+    while (file_cache.lru_head != NULL)
+        file_cache_remove(file_cache.lru_head);
+    free(file_cache.buckets);
+    file_cache.buckets = NULL;
+    file_cache.num_buckets = 0;
+    if (file_cache.notify_fd != -1)
+        xclose(file_cache.notify_fd);
+    file_cache.notify_fd = -1;
+    for (i = 0; i < file_cache.num_watches; i++)
+        free(file_cache.watches[i].dir);
+    free(file_cache.watches);
+    file_cache.watches = NULL;
+    file_cache.num_watches = 0;
+}
+
+#ifdef HAVE_COMPRESS
+/* --compress: a request for a compressible file (or directory listing)
+ * that has no compressed copy in the cache yet is sent as it is, and hands
+ * the compressing to a background thread, one per process.  The finished
+ * entry goes on the done list of the loop that asked for it, and is put in
+ * the cache the next time that loop looks for one.
+ */
+#define COMPRESS_MIN 256    /* not worth it for anything smaller */
+#define COMPRESS_MAX_JOBS 64 /* per loop */
+
+struct compress_job {
+    struct compress_job *next;      /* in the queue, or a done list */
+    struct compress_job *loop_next; /* in the loop's jobs */
+    struct compress_loop *loop;
+    int encoding;                   /* ENCODING_* */
+    char *path;
+    off_t source_size;
+    uint64_t source_version;
+    char lastmod[DATE_LEN];
+    char etag[ETAG_LEN];
+    char *input;                    /* a generated reply, or NULL to read
+                                     * the file at path */
+    struct file_cache_entry *result;
+};
+
+static per_loop struct compress_loop {
+    struct compress_job *jobs;      /* everything not yet collected */
+    int num_jobs;
+    struct compress_job *done;      /* under compress_lock */
+} compress_loop;
+
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t compress_idle = PTHREAD_COND_INITIALIZER;
+static struct compress_job *compress_queue = NULL, *compress_running = NULL;
+static int compress_started = 0;
+
+/* What we can make. */
+static const unsigned int compress_encodings = 0
+#ifdef WITH_BROTLI
+    | 1u << ENCODING_BR
+#endif
+#ifdef WITH_ZSTD
+    | 1u << ENCODING_ZSTD
+#endif
+#ifdef WITH_ZLIB
+    | 1u << ENCODING_GZIP
+#endif
+    ;
+
+static int compressible(const char *mimetype) {
+    return strncmp(mimetype, "text/", 5) == 0 ||
+        strstr(mimetype, "javascript") != NULL ||
+        strstr(mimetype, "json") != NULL ||
+        strstr(mimetype, "xml") != NULL;
+}
+
+/* Compress len bytes at in, into a new buffer.  Returns NULL if that didn't
+ * work out.
+ */
+static char *compress_buf(const int encoding, const char *in,
+        const size_t len, size_t *out_len) {
+    char *out = NULL;
+
+    switch (encoding) {
+#ifdef WITH_BROTLI
+    case ENCODING_BR:
+        *out_len = BrotliEncoderMaxCompressedSize(len);
+        out = xmalloc(*out_len);
+        if (!BrotliEncoderCompress(9, BROTLI_DEFAULT_WINDOW,
+                BROTLI_MODE_TEXT, len, (const uint8_t *)in, out_len,
+                (uint8_t *)out)) {
+            free(out);
+            return NULL;
+        }
+        break;
+#endif
+#ifdef WITH_ZSTD
+    case ENCODING_ZSTD:
+        *out_len = ZSTD_compressBound(len);
+        out = xmalloc(*out_len);
+        *out_len = ZSTD_compress(out, *out_len, in, len, 15);
+        if (ZSTD_isError(*out_len)) {
+            free(out);
+            return NULL;
+        }
+        break;
+#endif
+#ifdef WITH_ZLIB
+    case ENCODING_GZIP: {
+        z_stream zs;
+
+        memset(&zs, 0, sizeof(zs));
+        /* 16 + max window bits = gzip wrapper */
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+                         8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return NULL;
+        *out_len = deflateBound(&zs, (uLong)len);
+        out = xmalloc(*out_len);
+        zs.next_in = (Bytef *)(uintptr_t)in;
+        zs.avail_in = (uInt)len;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = (uInt)*out_len;
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+            deflateEnd(&zs);
+            free(out);
+            return NULL;
+        }
+        *out_len = zs.total_out;
+        deflateEnd(&zs);
+        break;
     }
-    else if (strcmp(conn->method, "GET") == 0) {
-        process_get(conn);
+#endif
+    default:
+        (void)in;
+        (void)len;
+        (void)out_len;
     }
-    else if (strcmp(conn->method, "HEAD") == 0) {
-        process_get(conn);
-        conn->header_only = 1;
+    return out;
+}
+
+/* On the compress thread: read the file if need be, and make the entry.
+ * A file that has changed since it was asked for gives no entry at all, and
+ * one that doesn't get any smaller gives an entry with no data.
+ *
+ * Copies are only checked against the size and mtime of the file, so, as in
+ * file_cache_trust(), one changed within the current second isn't
+ * compressed: another change in the same second could leave both the same.
+ */
+static struct file_cache_entry *compress_run(struct compress_job *job) {
+    const size_t path_len = strlen(job->path);
+    const size_t len = (size_t)job->source_size;
+    struct file_cache_entry *e;
+    char *input = job->input, *out = NULL, *header = NULL;
+    size_t out_len = 0, header_length = 0;
+
+    if (input == NULL) {
+        struct stat st;
+        size_t done;
+        ssize_t got;
+        const time_t started = time(NULL);
+        int fd = open(job->path, O_RDONLY);
+
+        if (fd == -1)
+            return NULL;
+        if (fstat(fd, &st) == -1 || st.st_size != job->source_size ||
+                (uint64_t)st.st_mtime != job->source_version ||
+                st.st_mtime >= started || st.st_ctime >= started) {
+            close(fd);
+            return NULL;
+        }
+        input = xmalloc(len);
+        for (done = 0; done < len; done += (size_t)got) {
+            got = pread(fd, input + done, len - done, (off_t)done);
+            if (got <= 0) {
+                close(fd);
+                free(input);
+                return NULL;
+            }
+        }
+        close(fd);
     }
-    else if ((strcmp(conn->method, "OPTIONS") == 0) ||
-             (strcmp(conn->method, "POST") == 0) ||
-             (strcmp(conn->method, "PUT") == 0) ||
-             (strcmp(conn->method, "DELETE") == 0) ||
-             (strcmp(conn->method, "TRACE") == 0) ||
-             (strcmp(conn->method, "CONNECT") == 0)) {
-        default_reply(conn, 501, "Not Implemented",
-                      "The method you specified (%s) is not implemented.",
-                      conn->method);
+    out = compress_buf(job->encoding, input, len, &out_len);
+    if (input != job->input)
+        free(input);
+    if (out != NULL && out_len >= len - len / 10) {
+        /* Not worth it: remember that. */
+        free(out);
+        out = NULL;
+        out_len = 0;
     }
-    else {
-        default_reply(conn, 400, "Bad Request",
-                      "%s is not a valid HTTP/1.1 method.", conn->method);
+    if (out != NULL && job->input == NULL)
+        header_length = xasprintf(&header,
+            "Content-Length: %llu\r\n"
+            "Last-Modified: %s\r\n"
+            "ETag: %s\r\n"
+            "\r\n",
+            llu(out_len), job->lastmod, job->etag);
+
+    e = xmalloc(sizeof(*e) + path_len + 1 + header_length + out_len);
+    memcpy(e->path, job->path, path_len + 1);
+    e->header = e->path + path_len + 1;
+    if (header_length > 0)
+        memcpy(e->header, header, header_length);
+    free(header);
+    e->header_length = header_length;
+    e->data = NULL;
+    if (out != NULL) {
+        e->data = e->header + header_length;
+        memcpy(e->data, out, out_len);
+        free(out);
     }
+    e->mem = sizeof(*e) + path_len + 1 + header_length + out_len;
+    e->size = (off_t)out_len;
+    e->encoding = 1 + job->encoding;
+    e->hash = file_cache_hash(e->path, e->encoding);
+    e->source_size = job->source_size;
+    e->source_version = job->source_version;
+    memcpy(e->lastmod, job->lastmod, DATE_LEN);
+    memcpy(e->etag, job->etag, ETAG_LEN);
+    e->dev = 0;
+    e->ino = 0;
+    e->mtime = e->ctime = 0;
+    e->fd = -1;
+    e->wd = -1;
+    e->refs = 1;
+    return e;
+}
 
-    /* advance state */
-    conn->state = SEND_HEADER;
+static void *compress_thread(void *arg unused) {
+    struct compress_job *job;
 
-    /* request not needed anymore */
-    free(conn->request);
-    conn->request = NULL; /* important: don't free it again later */
+    pthread_mutex_lock(&compress_lock);
+    for (;;) {
+        while (compress_queue == NULL)
+            pthread_cond_wait(&compress_wake, &compress_lock);
+        job = compress_queue;
+        compress_queue = job->next;
+        compress_running = job;
+        pthread_mutex_unlock(&compress_lock);
+
+        job->result = compress_run(job);
+
+        pthread_mutex_lock(&compress_lock);
+        compress_running = NULL;
+        job->next = job->loop->done;
+        __atomic_store_n(&job->loop->done, job, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&compress_idle);
+    }
+    return NULL;
 }
 
-/* Receiving request. */
-static void poll_recv_request(struct connection *conn) {
-    char buf[1<<15];
-    ssize_t recvd;
+static void compress_free(struct compress_job *job) {
+    if (job->result != NULL)
+        file_cache_unref(job->result);
+    free(job->path);
+    free(job->input);
+    free(job);
+}
 
-    assert(conn->state == RECV_REQUEST);
-    recvd = recv(conn->socket, buf, sizeof(buf), 0);
+/* Queue up compressing the file at path (or the generated reply in input,
+ * which the job takes over, with no lastmod or etag), unless it's already
+ * on the way.
+ */
+static void compress_submit(const char *path, const int encoding,
+        const off_t source_size, const uint64_t source_version,
+        const char *lastmod, const char *etag, char *input) {
+    struct compress_job *job, **p;
+
+    for (job = compress_loop.jobs; job != NULL; job = job->loop_next)
+        if (job->encoding == encoding && strcmp(job->path, path) == 0)
+            break;
+    if (job != NULL || compress_loop.num_jobs >= COMPRESS_MAX_JOBS) {
+        free(input);
+        return;
+    }
+    job = xmalloc(sizeof(*job));
+    job->next = NULL;
+    job->loop_next = compress_loop.jobs;
+    compress_loop.jobs = job;
+    compress_loop.num_jobs++;
+    job->loop = &compress_loop;
+    job->encoding = encoding;
+    job->path = xstrdup(path);
+    job->source_size = source_size;
+    job->source_version = source_version;
+    if (lastmod != NULL) {
+        memcpy(job->lastmod, lastmod, DATE_LEN);
+        memcpy(job->etag, etag, ETAG_LEN);
+    }
+    else
+        job->lastmod[0] = job->etag[0] = '\0';
+    job->input = input;
+    job->result = NULL;
     if (debug)
-        printf("poll_recv_request(%d) got %d bytes\n",
-               conn->socket, (int)recvd);
-    if (recvd < 1) {
-        if (recvd == -1) {
-            if (errno == EAGAIN) {
-                if (debug) printf("poll_recv_request would have blocked\n");
-                return;
+        printf("compressing %s as %s\n", path, encodings[encoding].name);
+
+    pthread_mutex_lock(&compress_lock);
+    if (!compress_started) {
+        pthread_t thread;
+
+        errno = pthread_create(&thread, NULL, compress_thread, NULL);
+        if (errno != 0)
+            err(1, "pthread_create()");
+        pthread_detach(thread);
+        compress_started = 1;
+    }
+    for (p = &compress_queue; *p != NULL; p = &(*p)->next)
+        ;
+    *p = job;
+    pthread_cond_signal(&compress_wake);
+    pthread_mutex_unlock(&compress_lock);
+}
+
+/* Unlink a collected (or cancelled) job from the loop's list. */
+static void compress_forget(struct compress_job *job) {
+    struct compress_job **p = &compress_loop.jobs;
+
+    while (*p != job)
+        p = &(*p)->loop_next;
+    *p = job->loop_next;
+    compress_loop.num_jobs--;
+}
+
+/* Put finished jobs in the cache. */
+static void compress_collect(void) {
+    struct compress_job *job, *next;
+
+    if (__atomic_load_n(&compress_loop.done, __ATOMIC_ACQUIRE) == NULL)
+        return;
+    pthread_mutex_lock(&compress_lock);
+    job = compress_loop.done;
+    compress_loop.done = NULL;
+    pthread_mutex_unlock(&compress_lock);
+
+    for (; job != NULL; job = next) {
+        struct file_cache_entry *e = job->result, *old;
+
+        next = job->next;
+        compress_forget(job);
+        if (e != NULL && e->mem <= file_cache_size) {
+            old = file_cache_find(e->path, e->encoding);
+            if (old != NULL)
+                file_cache_remove(old);
+            e->checked = now;
+            file_cache_insert(e);
+            job->result = NULL;
+        }
+        compress_free(job);
+    }
+}
+
+/* Returns the compressed copy of what's at path, or NULL if there isn't an
+ * up to date one.
+ */
+static struct file_cache_entry *compress_lookup(const char *path,
+        const int encoding, const off_t source_size,
+        const uint64_t source_version) {
+    struct file_cache_entry *e;
+
+    compress_collect();
+    e = file_cache_find(path, 1 + encoding);
+    if (e == NULL || e->source_size != source_size ||
+            e->source_version != source_version) {
+        file_cache_misses++;
+        return NULL;
+    }
+    file_cache_hits++;
+    file_cache_touch(e);
+    return e;
+}
+
+/* The best encoding we can make that's in accepted, or -1. */
+static int compress_choose(const unsigned int accepted) {
+    size_t i;
+
+    for (i = 0; i < NUM_ENCODINGS; i++)
+        if (accepted & compress_encodings & (1u << i))
+            return (int)i;
+    return -1;
+}
+
+/* Called at the end of the loop: forget about its jobs, waiting for the one
+ * the compress thread is on, if it's ours.
+ */
+static void compress_exit(void) {
+    struct compress_job *job, *next, **p;
+
+    pthread_mutex_lock(&compress_lock);
+    for (p = &compress_queue; *p != NULL; ) {
+        job = *p;
+        if (job->loop == &compress_loop) {
+            *p = job->next;
+            compress_forget(job);
+            compress_free(job);
+        }
+        else
+            p = &job->next;
+    }
+    while (compress_running != NULL && compress_running->loop == &compress_loop)
+        pthread_cond_wait(&compress_idle, &compress_lock);
+    job = compress_loop.done;
+    compress_loop.done = NULL;
+    pthread_mutex_unlock(&compress_lock);
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        compress_forget(job);
+        compress_free(job);
+    }
+}
+
+/* 64-bit FNV-1a, to tell generated replies apart. */
+static uint64_t compress_hash(const char *s, const size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)s[i]) * 1099511628211ull;
+    return hash;
+}
+
+/* If there's a compressed copy of the file at target, with the given size
+ * and mtime, in an encoding the client takes, switch conn, *entry, *size and
+ * etag over to it and return the encoding.  Otherwise, have one made for
+ * next time.
+ */
+static const char *use_compressed(struct connection *conn, const char *target,
+        const char *mimetype, const unsigned int accepted,
+        const off_t source_size, const time_t mtime, const char *lastmod,
+        char *etag, struct file_cache_entry **entry, off_t *size) {
+    const int encoding = compress_choose(accepted);
+    struct file_cache_entry *e;
+    char tagged[ETAG_LEN];
+
+    if (encoding == -1 || !compressible(mimetype) ||
+            source_size < COMPRESS_MIN ||
+            source_size > (off_t)compress_max_file)
+        return NULL;
+    e = compress_lookup(target, encoding, source_size, (uint64_t)mtime);
+    if (e == NULL) {
+        memcpy(tagged, etag, ETAG_LEN);
+        etag_add_encoding(tagged, encodings[encoding].name);
+        compress_submit(target, encoding, source_size, (uint64_t)mtime,
+            lastmod, tagged, NULL);
+        return NULL;
+    }
+    if (e->data == NULL)
+        return NULL; /* wasn't worth it */
+
+    /* Drop the original.  If it's cached, the cache owns its fd. */
+    if (*entry == NULL)
+        xclose(conn->reply_fd);
+    conn->reply_fd = -1;
+    *entry = e;
+    *size = e->size;
+    memcpy(etag, e->etag, ETAG_LEN);
+    return encodings[encoding].name;
+}
+
+/* The same for the directory listing of path, in conn->reply.  Only the
+ * first stable_length bytes of it are used to tell listings apart, which
+ * leaves out the footer with the date.
+ */
+static const char *compress_listing(struct connection *conn,
+        const char *path, const size_t stable_length) {
+    const int encoding = compress_choose(accepted_encodings(conn));
+    const off_t length = conn->reply_length;
+    struct file_cache_entry *e;
+    uint64_t version;
+    char *copy;
+
+    if (encoding == -1 || length < COMPRESS_MIN ||
+            length > (off_t)compress_max_file)
+        return NULL;
+    version = compress_hash(conn->reply, stable_length);
+    e = compress_lookup(path, encoding, length, version);
+    if (e == NULL) {
+        copy = xmalloc((size_t)length);
+        memcpy(copy, conn->reply, (size_t)length);
+        compress_submit(path, encoding, length, version, NULL, NULL, copy);
+        return NULL;
+    }
+    if (e->data == NULL)
+        return NULL;
+
+    free(conn->reply);
+    e->refs++;
+    conn->cache_entry = e;
+    conn->reply = e->data;
+    conn->reply_length = e->size;
+    conn->reply_dont_free = 1;
+    return encodings[encoding].name;
+}
+#endif
+
+/* Open the file at target for conn, and stat it into filestat.  If that
+ * doesn't work out, or it's not a regular file, sets up the reply and
+ * returns 0.
+ */
+static int open_file(struct connection *conn, const char *target,
+        struct stat *filestat) {
+    conn->reply_fd = open(target, O_RDONLY | O_NONBLOCK);
+
+    if (conn->reply_fd == -1) {
+        /* open() failed */
+        if (errno == EACCES)
+            default_reply(conn, 403, "Forbidden",
+                "You don't have permission to access (%s).", conn->url);
+        else if (errno == ENOENT)
+            default_reply(conn, 404, "Not Found",
+                "The URL you requested (%s) was not found.", conn->url);
+        else
+            default_reply(conn, 500, "Internal Server Error",
+                "The URL you requested (%s) cannot be returned: %s.",
+                conn->url, strerror(errno));
+
+        return 0;
+    }
+
+    /* stat the file */
+    if (fstat(conn->reply_fd, filestat) == -1) {
+        default_reply(conn, 500, "Internal Server Error",
+            "fstat() failed: %s.", strerror(errno));
+        return 0;
+    }
+
+    /* make sure it's a regular file */
+    if (S_ISDIR(filestat->st_mode)) {
+        redirect(conn, "%s/", conn->url);
+        return 0;
+    }
+    else if (!S_ISREG(filestat->st_mode)) {
+        default_reply(conn, 403, "Forbidden", "Not a regular file.");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Now that conn->reply_fd is open on the file at target, with the given
+ * stat, fill in lastmod and etag, and put it in the cache if it'll go there.
+ * Returns the entry, if so.
+ */
+static struct file_cache_entry *cache_opened_file(struct connection *conn,
+        const char *target, const struct stat *st, char *lastmod,
+        char *etag) {
+    struct file_cache_entry *entry;
+
+    rfc1123_date(lastmod, st->st_mtime);
+    make_etag(etag, st);
+    entry = file_cache_fill(target, conn->reply_fd, st, lastmod);
+    if (entry != NULL && entry->data != NULL) {
+        /* Don't need the file any more. */
+        xclose(conn->reply_fd);
+        conn->reply_fd = -1;
+    }
+    return entry;
+}
+
+/* --precompressed: look for a sidecar of the file at target, in one of the
+ * accepted encodings, that's no older than the file (which was modified at
+ * mtime).  If there is one, switches conn, *entry, *size, lastmod and etag
+ * over to it, leaves target naming it, and returns the encoding.  There must
+ * be room to add MAX_ENCODING_EXT to target.
+ */
+static const char *open_precompressed(struct connection *conn, char *target,
+        const unsigned int accepted, const time_t mtime,
+        struct file_cache_entry **entry, off_t *size, char *lastmod,
+        char *etag) {
+    const size_t len = strlen(target);
+    struct file_cache_entry *e;
+    struct stat st;
+    size_t i;
+    int fd = -1;
+
+    for (i = 0; i < NUM_ENCODINGS; i++) {
+        if (!(accepted & (1u << i)))
+            continue;
+        strcpy(target + len, encodings[i].ext);
+        e = file_cache_lookup(target);
+        if (e != NULL) {
+            if (e->mtime < mtime)
+                continue;
+        }
+        else {
+            fd = open(target, O_RDONLY | O_NONBLOCK);
+            if (fd == -1)
+                continue;
+            if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+                    st.st_mtime < mtime) {
+                xclose(fd);
+                continue;
             }
-            if (debug) printf("recv(%d) error: %s\n",
-                conn->socket, strerror(errno));
         }
-        conn->conn_close = 1;
-        conn->state = DONE;
-        return;
+
+        /* Drop the original.  If it's cached, the cache owns its fd. */
+        if (*entry == NULL)
+            xclose(conn->reply_fd);
+        conn->reply_fd = -1;
+
+        *entry = e;
+        if (e != NULL) {
+            *size = e->size;
+            memcpy(lastmod, e->lastmod, DATE_LEN);
+            memcpy(etag, e->etag, ETAG_LEN);
+        }
+        else {
+            conn->reply_fd = fd;
+            *size = st.st_size;
+            *entry = cache_opened_file(conn, target, &st, lastmod, etag);
+        }
+        return encodings[i].name;
     }
-    conn->last_active = now;
+    target[len] = '\0';
+    return NULL;
+}
 
-    /* append to conn->request */
-    assert(recvd > 0);
-    conn->request = xrealloc(
-        conn->request, conn->request_length + (size_t)recvd + 1);
-    memcpy(conn->request+conn->request_length, buf, (size_t)recvd);
-    conn->request_length += (size_t)recvd;
-    conn->request[conn->request_length] = 0;
-    total_in += (size_t)recvd;
+/* Is etag in an If-None-Match or If-Range list?  The weak comparison
+ * ignores W/ on the client's tags; the strong one never matches them.
+ * Our own tags are all strong.
+ */
+static int etag_match(const char *list, const char *etag, const int weak) {
+    const size_t len = strlen(etag);
+    const char *p = list, *end;
+    int is_weak;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '\0')
+            return 0;
+        if (*p == '*')
+            return 1;
+        is_weak = (p[0] == 'W' && p[1] == '/');
+        if (is_weak)
+            p += 2;
+        if (*p != '"' || (end = strchr(p + 1, '"')) == NULL)
+            return 0; /* malformed */
+        end++;
+        if ((weak || !is_weak) && (size_t)(end - p) == len &&
+                memcmp(p, etag, len) == 0)
+            return 1;
+        p = end;
+    }
+}
+
+/* Does the client already have what we'd send, going by the validators of
+ * the file?  If-None-Match wins over If-Modified-Since when there are both.
+ */
+static int not_modified(struct connection *conn, const char *lastmod,
+        const char *etag) {
+    const char *field = parse_field(conn, FIELD_IF_NONE_MATCH);
+    time_t since;
+
+    if (field != NULL)
+        return etag_match(field, etag, 1);
+    field = parse_field(conn, FIELD_IF_MODIFIED_SINCE);
+    if (field == NULL)
+        return 0;
+    if (strcmp(field, lastmod) == 0)
+        return 1;
+    since = parse_http_date(field);
+    return since != -1 && parse_http_date(lastmod) <= since;
+}
 
-    /* process request if we have all of it */
-    if ((conn->request_length > 2) &&
-        (memcmp(conn->request+conn->request_length-2, "\n\n", 2) == 0))
-            process_request(conn);
-    else if ((conn->request_length > 4) &&
-        (memcmp(conn->request+conn->request_length-4, "\r\n\r\n", 4) == 0))
-            process_request(conn);
+/* Should a Range request be honoured?  Not if it has an If-Range that the
+ * file has moved on from.
+ */
+static int if_range(struct connection *conn, const char *lastmod,
+        const char *etag) {
+    const char *field = parse_field(conn, FIELD_IF_RANGE);
 
-    /* die if it's too large */
-    if (conn->request_length > MAX_REQUEST_LENGTH) {
-        default_reply(conn, 413, "Request Entity Too Large",
-                      "Your request was dropped because it was too long.");
-        conn->state = SEND_HEADER;
+    if (field == NULL)
+        return 1;
+    if (field[0] == '"' || (field[0] == 'W' && field[1] == '/'))
+        return etag_match(field, etag, 0);
+    return strcmp(field, lastmod) == 0;
+}
+
+static void reply_not_modified(struct connection *conn, const char *etag) {
+    if (debug)
+        printf("not modified: %s\n", etag);
+    conn->http_code = 304;
+    header_start(conn, 304, "Not Modified");
+    header_literal(conn, "Accept-Ranges: bytes\r\n");
+    header_append(conn, keep_alive(conn));
+    if (want_precompressed || want_compress)
+        header_literal(conn, "Vary: Accept-Encoding\r\n");
+    header_literal(conn, "ETag: ");
+    header_append(conn, etag);
+    header_literal(conn, "\r\n\r\n");
+    conn->reply_length = 0;
+    conn->reply_type = REPLY_GENERATED;
+    conn->header_only = 1;
+}
+
+/* Resolve ranges[] against a file of the given size: drop the ones that
+ * aren't in it, sort the rest, and merge the ones that overlap or touch so
+ * no byte is sent twice.  Returns how many are left.
+ */
+static size_t resolve_ranges(struct connection *conn, const off_t size) {
+    struct byterange *r = conn->ranges;
+    size_t i, j, n = 0;
+
+    for (i = 0; i < conn->num_ranges; i++) {
+        off_t from = r[i].from, to = r[i].to;
+
+        if (from == -1) {
+            /* -200 :: yields last 200 */
+            from = size - to;
+            if (from < 0)
+                from = 0;
+            to = size - 1;
+        }
+        else if (to == -1 || to > size - 1)
+            to = size - 1;
+        if (from >= size || to < from)
+            continue;
+
+        /* insert in order of from, over ones already looked at */
+        for (j = n; j > 0 && r[j - 1].from > from; j--)
+            r[j] = r[j - 1];
+        r[j].from = from;
+        r[j].to = to;
+        n++;
     }
 
-    /* if we've moved on to the next state, try to send right away, instead of
-     * going through another iteration of the select() loop.
-     */
-    if (conn->state == SEND_HEADER)
-        poll_send_header(conn);
+    for (i = 0, j = 0; i < n; i++)
+        if (j > 0 && r[i].from <= r[j - 1].to + 1) {
+            if (r[i].to > r[j - 1].to)
+                r[j - 1].to = r[i].to;
+        }
+        else
+            r[j++] = r[i];
+    conn->num_ranges = j;
+    return j;
 }
 
-/* Sending header.  Assumes conn->header is not NULL. */
-static void poll_send_header(struct connection *conn) {
-    ssize_t sent;
+/* Set up a multipart/byteranges reply for the resolved ranges[].  The part
+ * headers and the closing boundary are built here into multipart, and
+ * reply_segment() interleaves them with the ranges of the file.
+ */
+static void multipart_reply(struct connection *conn, const off_t size,
+        const char *mimetype, const char *encoding, const char *lastmod,
+        const char *etag) {
+    struct apbuf *parts = make_apbuf();
+    char boundary[17];
+    off_t length = 0;
+    size_t i;
 
-    assert(conn->state == SEND_HEADER);
-    assert(conn->header_length == strlen(conn->header));
+    *hex_number(boundary, llu(now_ms * 0x9e3779b97f4a7c15ULL ^
+        num_requests)) = '\0';
+    for (i = 0; i < conn->num_ranges; i++) {
+        struct byterange *r = &conn->ranges[i];
+
+        r->part = parts->length;
+        appendf(parts, "%s--%s\r\nContent-Type: %s\r\n"
+            "Content-Range: bytes %llu-%llu/%llu\r\n\r\n",
+            i > 0 ? "\r\n" : "", boundary, mimetype,
+            llu(r->from), llu(r->to), llu(size));
+        length += r->to - r->from + 1;
+    }
+    conn->ranges[i].part = parts->length;
+    appendf(parts, "\r\n--%s--\r\n", boundary);
+
+    conn->multipart_length = parts->length;
+    conn->multipart = arena_alloc(&conn->arena, parts->length);
+    memcpy(conn->multipart, parts->str, parts->length);
+    free(parts->str);
+    free(parts);
+    conn->reply_start = 0;
+    conn->reply_length = length + (off_t)conn->multipart_length;
+
+    header_start(conn, 206, "Partial Content");
+    header_literal(conn, "Accept-Ranges: bytes\r\n");
+    header_append(conn, keep_alive(conn));
+    header_encoding(conn, encoding);
+    header_literal(conn, "Content-Length: ");
+    header_number(conn, llu(conn->reply_length));
+    header_literal(conn, "\r\nContent-Type: multipart/byteranges; boundary=");
+    header_append(conn, boundary);
+    header_literal(conn, "\r\nLast-Modified: ");
+    header_appendl(conn, lastmod, DATE_LEN - 1);
+    header_literal(conn, "\r\nETag: ");
+    header_append(conn, etag);
+    header_literal(conn, "\r\n\r\n");
+    conn->http_code = 206;
+    if (debug)
+        printf("sending %llu ranges of %llu\n",
+               llu(conn->num_ranges), llu(size));
+}
+
+/* Process a GET/HEAD request. */
+static void process_get(struct connection *conn) {
+    char *decoded_url, *target;
+    char lastmod[DATE_LEN], etag[ETAG_LEN];
+    const char *mimetype = NULL;
+    const char *forward_to = NULL;
+    const char *encoding = NULL;
+    struct stat filestat;
+    struct file_cache_entry *entry;
+    const size_t root_len = strlen(wwwroot);
+    size_t decoded_len;
+    off_t size;
+
+    /* Work out the path of the file being requested, right after wwwroot in
+     * target, with room to add index_name and a sidecar extension.
+     */
+    target = arena_alloc(&conn->arena, root_len + strlen(conn->url) +
+        strlen(index_name) + MAX_ENCODING_EXT + 1);
+    memcpy(target, wwwroot, root_len);
+    decoded_url = make_safe_url(conn->url, target + root_len);
+
+    /* make sure it's safe */
+    if (decoded_url == NULL) {
+        default_reply(conn, 400, "Bad Request",
+                      "You requested an invalid URL: %s", conn->url);
+        return;
+    }
+    decoded_len = strlen(decoded_url);
+    conn->decoded_url = decoded_url;
+
+    /* test the host against web forward options */
+    if (forward_map) {
+        char *host = parse_field(conn, FIELD_HOST);
+        if (host) {
+            size_t i;
+            if (debug)
+                printf("host=\"%s\"\n", host);
+            for (i = 0; i < forward_map_size; i++) {
+                if (strcasecmp(forward_map[i].host, host) == 0) {
+                    forward_to = forward_map[i].target_url;
+                    break;
+                }
+            }
+        }
+    }
+    if (!forward_to) {
+        forward_to = forward_all_url;
+    }
+    if (forward_to) {
+        redirect(conn, "%s%s", forward_to, decoded_url);
+        return;
+    }
+
+    /* does it end in a slash? serve up url/index_name */
+    if (decoded_url[decoded_len - 1] == '/') {
+        strcpy(decoded_url + decoded_len, index_name);
+        entry = file_cache_lookup(target);
+        if (entry == NULL && !file_exists(target)) {
+            if (no_listing) {
+                /* Return 404 instead of 403 to make --no-listing
+                 * indistinguishable from the directory not existing.
+                 * i.e.: Don't leak information.
+                 */
+                default_reply(conn, 404, "Not Found",
+                    "The URL you requested (%s) was not found.", conn->url);
+                return;
+            }
+            decoded_url[decoded_len] = '\0';
+            generate_dir_listing(conn, target);
+            return;
+        }
+        mimetype = url_content_type(index_name);
+    }
+    else {
+        /* points to a file */
+        entry = file_cache_lookup(target);
+        mimetype = url_content_type(decoded_url);
+    }
+    if (debug)
+        printf("url=\"%s\", target=\"%s\", content-type=\"%s\"%s\n",
+               conn->url, target, mimetype, entry ? " (cached)" : "");
+
+    if (entry != NULL) {
+        size = entry->size;
+        memcpy(lastmod, entry->lastmod, DATE_LEN);
+        memcpy(etag, entry->etag, ETAG_LEN);
+    }
+    else {
+        /* A revalidation that comes out unchanged doesn't need the file
+         * opened at all, as long as open_file() would have let us.
+         */
+        if ((conn->fields[FIELD_IF_NONE_MATCH].start != 0 ||
+                conn->fields[FIELD_IF_MODIFIED_SINCE].start != 0) &&
+                stat(target, &filestat) == 0 && S_ISREG(filestat.st_mode) &&
+                access(target, R_OK) == 0) {
+            rfc1123_date(lastmod, filestat.st_mtime);
+            make_etag(etag, &filestat);
+            if (not_modified(conn, lastmod, etag)) {
+                reply_not_modified(conn, etag);
+                return;
+            }
+        }
+        if (!open_file(conn, target, &filestat))
+            return;
+        size = filestat.st_size;
+        entry = cache_opened_file(conn, target, &filestat, lastmod, etag);
+    }
+
+    if (want_precompressed || want_compress) {
+        const unsigned int accepted = accepted_encodings(conn);
+        const time_t mtime = entry ? entry->mtime : filestat.st_mtime;
+
+        if (want_precompressed)
+            encoding = open_precompressed(conn, target, accepted, mtime,
+                &entry, &size, lastmod, etag);
+#ifdef HAVE_COMPRESS
+        if (want_compress && encoding == NULL)
+            encoding = use_compressed(conn, target, mimetype, accepted,
+                size, mtime, lastmod, etag, &entry, &size);
+#endif
+        if (debug && encoding != NULL)
+            printf("sending \"%s\" as %s\n", target, encoding);
+    }
+
+    conn->reply_type = REPLY_FROMFILE;
+    if (entry != NULL) {
+        /* Send it from the cache, and keep it alive until we're done. */
+        entry->refs++;
+        conn->cache_entry = entry;
+        conn->reply_fd = entry->fd;
+        if (entry->data != NULL) {
+            conn->reply_type = REPLY_GENERATED;
+            conn->reply = entry->data;
+            conn->reply_dont_free = 1;
+        }
+    }
+
+    /* check for If-None-Match and If-Modified-Since, may not have to send */
+    if (not_modified(conn, lastmod, etag)) {
+        reply_not_modified(conn, etag);
+        return;
+    }
+
+    if (conn->num_ranges > 1 && if_range(conn, lastmod, etag)) {
+        if (resolve_ranges(conn, size) == 0) {
+            default_reply(conn, 416, "Requested Range Not Satisfiable",
+                "None of the ranges you requested are in the file.");
+            return;
+        }
+        if (conn->num_ranges > 1) {
+            multipart_reply(conn, size, mimetype, encoding, lastmod, etag);
+            return;
+        }
+        /* they came down to one, send it as usual */
+        conn->range_begin = conn->ranges[0].from;
+        conn->range_end = conn->ranges[0].to;
+        conn->range_begin_given = conn->range_end_given = 1;
+    }
+
+    if ((conn->range_begin_given || conn->range_end_given) &&
+            if_range(conn, lastmod, etag)) {
+        off_t from, to;
+
+        if (conn->range_begin_given && conn->range_end_given) {
+            /* 100-200 */
+            from = conn->range_begin;
+            to = conn->range_end;
+
+            /* clamp end to size-1 */
+            if (to > (size - 1))
+                to = size - 1;
+        }
+        else if (conn->range_begin_given && !conn->range_end_given) {
+            /* 100- :: yields 100 to end */
+            from = conn->range_begin;
+            to = size - 1;
+        }
+        else if (!conn->range_begin_given && conn->range_end_given) {
+            /* -200 :: yields last 200 */
+            to = size - 1;
+            from = to - conn->range_end + 1;
+
+            /* clamp start */
+            if (from < 0)
+                from = 0;
+        }
+        else
+            errx(1, "internal error - from/to mismatch");
+
+        if (from >= size) {
+            default_reply(conn, 416, "Requested Range Not Satisfiable",
+                "You requested a range outside of the file.");
+            return;
+        }
+
+        if (to < from) {
+            default_reply(conn, 416, "Requested Range Not Satisfiable",
+                "You requested a backward range.");
+            return;
+        }
+
+        conn->reply_start = from;
+        conn->reply_length = to - from + 1;
+
+        header_start(conn, 206, "Partial Content");
+        header_literal(conn, "Accept-Ranges: bytes\r\n");
+        header_append(conn, keep_alive(conn));
+        header_encoding(conn, encoding);
+        header_literal(conn, "Content-Length: ");
+        header_number(conn, llu(conn->reply_length));
+        header_literal(conn, "\r\nContent-Range: bytes ");
+        header_number(conn, llu(from));
+        header_literal(conn, "-");
+        header_number(conn, llu(to));
+        header_literal(conn, "/");
+        header_number(conn, llu(size));
+        header_literal(conn, "\r\nContent-Type: ");
+        header_append(conn, mimetype);
+        header_literal(conn, "\r\nLast-Modified: ");
+        header_appendl(conn, lastmod, DATE_LEN - 1);
+        header_literal(conn, "\r\nETag: ");
+        header_append(conn, etag);
+        header_literal(conn, "\r\n\r\n");
+        conn->http_code = 206;
+        if (debug)
+            printf("sending %llu-%llu/%llu\n",
+                   llu(from), llu(to), llu(size));
+    }
+    else {
+        /* no range stuff */
+        conn->reply_length = size;
+        header_start(conn, 200, "OK");
+        header_literal(conn, "Accept-Ranges: bytes\r\n");
+        header_append(conn, keep_alive(conn));
+        header_encoding(conn, encoding);
+        header_literal(conn, "Content-Type: ");
+        header_append(conn, mimetype);
+        header_literal(conn, "\r\n");
+        conn->http_code = 200;
+        if (entry != NULL) {
+            header_appendl(conn, entry->header, entry->header_length);
+            return;
+        }
+        header_literal(conn, "Content-Length: ");
+        header_number(conn, llu(conn->reply_length));
+        header_literal(conn, "\r\nLast-Modified: ");
+        header_appendl(conn, lastmod, DATE_LEN - 1);
+        header_literal(conn, "\r\nETag: ");
+        header_append(conn, etag);
+        header_literal(conn, "\r\n\r\n");
+    }
+}
+
+/* Rate limiting.  Each connection has a token bucket for its own limit, and
+ * with --client-rate-limit, shares one with the client's other connections.
+ * Sending takes no more than the buckets hold, and a connection that has
+ * run dry is parked on a TIMER_SHAPE timer, out of the poller, until they
+ * have refilled some.
+ */
+/* Top up b for the time since it was last filled.  Returns what's in it. */
+static off_t bucket_fill(struct bucket *b, const off_t rate) {
+    uint64_t ms = now_ms - b->refill_ms;
+
+    if (ms > 1000)
+        ms = 1000;
+    b->tokens += (off_t)ms * rate / 1000;
+    if (b->tokens > rate)
+        b->tokens = rate;
+    b->refill_ms = now_ms;
+    return b->tokens;
+}
+
+/* A client's bucket outlives its connections until it has filled back up,
+ * so that reconnecting doesn't get a client a fresh one.
+ */
+#define CLIENT_BUCKETS 256
+
+struct client_bucket {
+    struct client_bucket *next;
+    int refs;           /* connections using it */
+    struct bucket bucket;
+    unsigned char client[sizeof(((struct connection *)0)->client)];
+};
+static per_loop struct client_bucket *client_buckets[CLIENT_BUCKETS];
+
+static struct client_bucket **client_bucket_slot(const void *client) {
+    const unsigned char *p = client;
+    unsigned int h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(((struct connection *)0)->client); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return &client_buckets[h % CLIENT_BUCKETS];
+}
+
+static struct client_bucket *client_bucket_get(const struct connection *conn) {
+    struct client_bucket **slot = client_bucket_slot(&conn->client), **p, *c;
+
+    for (p = slot; (c = *p) != NULL; ) {
+        if (memcmp(c->client, &conn->client, sizeof(c->client)) == 0) {
+            c->refs++;
+            return c;
+        }
+        if (c->refs == 0 && bucket_fill(&c->bucket, client_rate_limit) ==
+                client_rate_limit) {
+            *p = c->next; /* unused and full, so it's no use any more */
+            free(c);
+        }
+        else
+            p = &c->next;
+    }
+    c = xmalloc(sizeof(*c));
+    memcpy(c->client, &conn->client, sizeof(c->client));
+    c->refs = 1;
+    c->bucket.tokens = 0;
+    c->bucket.refill_ms = 0;
+    c->next = *slot;
+    *slot = c;
+    return c;
+}
+
+static void client_bucket_put(struct client_bucket *c) {
+    struct client_bucket **p;
+
+    if (--c->refs > 0 ||
+            bucket_fill(&c->bucket, client_rate_limit) < client_rate_limit)
+        return; /* client_bucket_get() will see to it */
+    for (p = client_bucket_slot(c->client); *p != c; p = &(*p)->next)
+        ;
+    *p = c->next;
+    free(c);
+}
+
+static void client_buckets_destroy(void) {
+    struct client_bucket *c;
+    int i;
+
+    for (i = 0; i < CLIENT_BUCKETS; i++)
+        while ((c = client_buckets[i]) != NULL) {
+            client_buckets[i] = c->next;
+            free(c);
+        }
+}
+
+/* How long until b has a tick's worth in it, in ms. */
+static uint64_t bucket_wait(const struct bucket *b, const off_t rate) {
+    const off_t want = rate * TIMER_TICK_MS / 1000 + 1;
+
+    if (b->tokens >= want)
+        return 0;
+    return (uint64_t)((want - b->tokens) * 1000 / rate) + 1;
+}
+
+/* Work out whether this reply is rate limited, and at what rate. */
+static void shape_reply(struct connection *conn) {
+    off_t rate = rate_limit;
+    size_t i, longest = 0;
+
+    conn->shaped = 0;
+    if (conn->header_only || conn->reply_length == 0)
+        return;
+    /* Match what's been decoded and tidied up, so that /%69so/ and //iso/
+     * are /iso/ too.
+     */
+    if (conn->decoded_url != NULL)
+        for (i = 0; i < rate_map_size; i++)
+            if (rate_map[i].length >= longest && strncmp(conn->decoded_url,
+                    rate_map[i].prefix, rate_map[i].length) == 0) {
+                rate = rate_map[i].rate;
+                longest = rate_map[i].length;
+            }
+    if (client_rate_limit > 0 && conn->client_bucket == NULL)
+        conn->client_bucket = client_bucket_get(conn);
+    conn->rate = rate;
+    conn->shaped = (rate > 0 || conn->client_bucket != NULL);
+}
+
+/* Take n from conn's buckets, or give it back if it's negative. */
+static void shape_charge(struct connection *conn, const off_t n) {
+    if (conn->rate > 0)
+        conn->bucket.tokens -= n;
+    if (conn->client_bucket != NULL)
+        conn->client_bucket->bucket.tokens -= n;
+}
+
+/* How much of want conn may send now, which is taken from its buckets
+ * straight away, so that other connections sharing the client's can't
+ * have it too while it's being sent.  Whatever doesn't get sent should be
+ * given back.  If there's nothing, conn is parked until there's some.
+ */
+static off_t shape_allowance(struct connection *conn, off_t want) {
+    uint64_t wait = 0, w;
+
+    if (conn->rate > 0 && want > bucket_fill(&conn->bucket, conn->rate)) {
+        want = conn->bucket.tokens;
+        wait = bucket_wait(&conn->bucket, conn->rate);
+    }
+    if (conn->client_bucket != NULL && want >
+            bucket_fill(&conn->client_bucket->bucket, client_rate_limit)) {
+        want = conn->client_bucket->bucket.tokens;
+        w = bucket_wait(&conn->client_bucket->bucket, client_rate_limit);
+        if (wait < w)
+            wait = w;
+    }
+    if (want > 0) {
+        shape_charge(conn, want);
+        return want;
+    }
+    if (debug)
+        printf("shape(%d) parked for %llu ms\n", conn->socket, llu(wait));
+    timer_at(conn, TIMER_SHAPE, now_ms + wait);
+    return 0;
+}
+
+/* Whether conn's buckets have n for it right now, without waiting. */
+static int shape_covers(struct connection *conn, const off_t n) {
+    return (conn->rate == 0 || bucket_fill(&conn->bucket, conn->rate) >= n)
+        && (conn->client_bucket == NULL || bucket_fill(
+            &conn->client_bucket->bucket, client_rate_limit) >= n);
+}
+
+/* conn's buckets should have refilled: go back to sending. */
+static void shape_resume(struct connection *conn) {
+    timer_set(conn, TIMER_SEND);
+#ifdef HAVE_IO_URING
+    if (poller == POLLER_URING) {
+        if (conn->uring_inflight == 0)
+            uring_arm(conn);
+        return;
+    }
+#endif
+    poll_connection(conn, 0, 1);
+}
+
+/* Process a request: build the header and reply, advance state. */
+static void process_request(struct connection *conn) {
+    num_requests++;
+    conn->started_ms = now_ms;
+
+    if (!parse_request(conn)) {
+        default_reply(conn, 400, "Bad Request",
+            "You sent a request that the server couldn't understand.");
+    }
+    /* fail if: (auth_enabled) AND (client supplied invalid credentials) */
+    else if (auth_key != NULL &&
+            (conn->authorization == NULL ||
+             strcmp(conn->authorization, auth_key)))
+    {
+        default_reply(conn, 401, "Unauthorized",
+            "Access denied due to invalid credentials.");
+    }
+    else if (strcmp(conn->method, "GET") == 0) {
+        process_get(conn);
+    }
+    else if (strcmp(conn->method, "HEAD") == 0) {
+        process_get(conn);
+        conn->header_only = 1;
+    }
+    else if ((strcmp(conn->method, "OPTIONS") == 0) ||
+             (strcmp(conn->method, "POST") == 0) ||
+             (strcmp(conn->method, "PUT") == 0) ||
+             (strcmp(conn->method, "DELETE") == 0) ||
+             (strcmp(conn->method, "TRACE") == 0) ||
+             (strcmp(conn->method, "CONNECT") == 0)) {
+        default_reply(conn, 501, "Not Implemented",
+                      "The method you specified (%s) is not implemented.",
+                      conn->method);
+    }
+    else {
+        default_reply(conn, 400, "Bad Request",
+                      "%s is not a valid HTTP/1.1 method.", conn->method);
+    }
+
+    if (shaping)
+        shape_reply(conn);
+
+    /* advance state */
+    conn->state = SEND_HEADER;
+}
+
+/* Throw away input that's already arrived.  If we close a socket with unread
+ * data, the client gets a reset instead of our reply.
+ */
+static void discard_input(const struct connection *conn) {
+    char buf[4096];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        if (recv(conn->socket, buf, sizeof(buf), 0) < (ssize_t)sizeof(buf))
+            break;
+}
+
+/* Look for the blank line at the end of the request header, carrying on
+ * from where the last look stopped.  Returns the length of the header, or 0
+ * if it's not all here yet.
+ */
+static size_t find_header_end(struct connection *conn) {
+    const char *r = conn->request, *end = r + conn->request_length;
+    const char *p = r + conn->header_scan;
+
+    while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        /* "\n\n" or "\n\r\n" */
+        if ((p - r >= 1 && p[-1] == '\n') ||
+                (p - r >= 2 && p[-1] == '\r' && p[-2] == '\n'))
+            return (size_t)(p + 1 - r);
+        p++;
+    }
+    conn->header_scan = conn->request_length;
+    return 0;
+}
+
+/* Handle the outcome of receiving part of a request into the end of
+ * conn->request, and process the request if we have all of it.  recvd is
+ * what recv() returned.
+ */
+static void handle_recv_request(struct connection *conn,
+        const ssize_t recvd) {
+    if (debug)
+        printf("poll_recv_request(%d) got %d bytes\n",
+               conn->socket, (int)recvd);
+    if (recvd < 1) {
+        if (recvd == -1) {
+            if (errno == EAGAIN) {
+                if (debug) printf("poll_recv_request would have blocked\n");
+                return;
+            }
+            if (debug) printf("recv(%d) error: %s\n",
+                conn->socket, strerror(errno));
+        }
+        conn->conn_close = 1;
+        conn->state = DONE;
+        return;
+    }
+    /* The header deadline runs from the start of the request, and isn't
+     * pushed back by each piece of it that trickles in.
+     */
+    if (conn->request_length == 0 && conn->timer != TIMER_HEADER)
+        timer_set(conn, TIMER_HEADER);
+
+    assert(recvd > 0);
+    assert(conn->request_length + (size_t)recvd <= MAX_REQUEST_LENGTH);
+    conn->request_length += (size_t)recvd;
+    total_in += (size_t)recvd;
+    check_request(conn);
+}
+
+/* Process the request in conn->request if we have all of it.  Anything after
+ * its header is kept for next time.
+ */
+static void check_request(struct connection *conn) {
+    const size_t header_length = find_header_end(conn);
+
+    if (header_length > 0) {
+        conn->pipelined = conn->request_length - header_length;
+        conn->pipelined_first = conn->request[header_length];
+        conn->request_length = header_length;
+        conn->request[header_length] = '\0';
+        process_request(conn);
+    }
+    /* die if it's too large */
+    else if (conn->request_length == MAX_REQUEST_LENGTH) {
+        discard_input(conn);
+        default_reply(conn, 413, "Request Entity Too Large",
+                      "Your request was dropped because it was too long.");
+        conn->state = SEND_HEADER;
+    }
+    if (conn->state == SEND_HEADER)
+        timer_set(conn, TIMER_SEND);
+}
+
+/* Receiving request. */
+static void poll_recv_request(struct connection *conn) {
+    ssize_t recvd;
+
+    assert(conn->state == RECV_REQUEST);
+    recvd = recv(conn->socket, conn->request + conn->request_length,
+        MAX_REQUEST_LENGTH - conn->request_length, 0);
+    handle_recv_request(conn, recvd);
+
+    /* if we've moved on to the next state, try to send right away, instead of
+     * going through another iteration of the event loop.
+     */
+    if (conn->state == SEND_HEADER)
+        poll_send_header(conn);
+}
+
+/* A reply has gone out in full. */
+static void send_stats_reply(const struct connection *conn) {
+    const int large = !conn->header_only && conn->reply_length > SMALL_REPLY;
+    const uint64_t ms = now_ms - conn->started_ms;
+
+    send_stats.replies[large]++;
+    send_stats.reply_ms[large] += ms;
+    if (send_stats.max_reply_ms[large] < ms)
+        send_stats.max_reply_ms[large] = ms;
+}
+
+static void send_stats_add(struct send_stats *to,
+        const struct send_stats *from) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        to->replies[i] += from->replies[i];
+        to->reply_ms[i] += from->reply_ms[i];
+        if (to->max_reply_ms[i] < from->max_reply_ms[i])
+            to->max_reply_ms[i] = from->max_reply_ms[i];
+    }
+    to->busy_iterations += from->busy_iterations;
+    if (to->max_iteration_out < from->max_iteration_out)
+        to->max_iteration_out = from->max_iteration_out;
+}
+
+/* Handle the outcome of sending part of the header.  sent is what send()
+ * returned.
+ */
+static void handle_send_header(struct connection *conn, const ssize_t sent) {
+    if (debug)
+        printf("poll_send_header(%d) sent %d bytes\n",
+               conn->socket, (int)sent);
+
+    /* handle any errors (-1) or closure (0) in send() */
+    if (sent < 1) {
+        if ((sent == -1) && (errno == EAGAIN)) {
+            if (debug) printf("poll_send_header would have blocked\n");
+            return;
+        }
+        if (debug && (sent == -1))
+            printf("send(%d) error: %s\n", conn->socket, strerror(errno));
+        conn->conn_close = 1;
+        conn->state = DONE;
+        return;
+    }
+    assert(sent > 0);
+    timer_set(conn, TIMER_SEND);
+    conn->header_sent += (size_t)sent;
+    conn->total_sent += (size_t)sent;
+    total_out += (size_t)sent;
+
+    /* check if we're done sending header */
+    if (conn->header_sent == conn->header_length) {
+        if (conn->header_only) {
+            conn->state = DONE;
+            send_stats_reply(conn);
+        }
+        else
+            conn->state = SEND_REPLY;
+    }
+}
+
+/* Where the reply goes on from reply_sent: in memory at *mem, or if that's
+ * NULL, at *ofs in reply_fd.  Returns how much of it there is before that
+ * changes, which for anything but a multipart/byteranges reply is the rest
+ * of it.  In one of those, the part headers come from multipart and the
+ * ranges from the file (or the cached copy of it) in between.
+ */
+static off_t reply_segment(const struct connection *conn, const char **mem,
+        off_t *ofs) {
+    off_t pos = conn->reply_sent, len, at;
+    size_t i;
+
+    if (conn->multipart == NULL) {
+        at = conn->reply_start + pos;
+        len = conn->reply_length - pos;
+    }
+    else
+        for (i = 0; ; i++) {
+            const struct byterange *r = &conn->ranges[i];
+
+            len = (off_t)(((i < conn->num_ranges) ? r[1].part :
+                conn->multipart_length) - r->part);
+            if (pos < len || i == conn->num_ranges) {
+                *mem = conn->multipart + r->part + pos;
+                return len - pos;
+            }
+            pos -= len;
+            len = r->to - r->from + 1;
+            if (pos < len) {
+                at = r->from + pos;
+                len -= pos;
+                break;
+            }
+            pos -= len;
+        }
+
+    if (conn->reply_type == REPLY_GENERATED)
+        *mem = conn->reply + at;
+    else {
+        *mem = NULL;
+        *ofs = at;
+    }
+    return len;
+}
+
+/* Send the rest of the header, and the reply along with it if we have it
+ * to hand: if it's generated, or a small file that we read in.  Otherwise
+ * MSG_MORE holds the header back to go out with the start of the reply.
+ * Returns what sendmsg() returned.
+ */
+static ssize_t send_header_once(struct connection *conn) {
+    struct send_buf *buf = NULL;
+    struct iovec iov[2];
+    struct msghdr msg;
+    int flags = 0;
+    ssize_t sent;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    iov[0].iov_base = conn->header + conn->header_sent;
+    iov[0].iov_len = conn->header_length - conn->header_sent;
+    if (!conn->header_only && conn->reply_length > 0) {
+        const char *mem;
+        off_t ofs, len = reply_segment(conn, &mem, &ofs);
+
+        if (conn->shaped && (len > SMALL_FILE || !shape_covers(conn, len)))
+            ; /* poll_send_reply() paces it */
+        else if (mem != NULL) {
+            iov[1].iov_base = (void *)(uintptr_t)mem;
+            iov[1].iov_len = (size_t)len;
+            msg.msg_iovlen = 2;
+        }
+        else if (len <= SMALL_FILE &&
+                (buf = send_buf_fill(conn, ofs, (size_t)len)) != NULL) {
+            /* kept for retries, and for send_pread() if it's partly sent */
+            iov[1].iov_base = buf->data + buf->start;
+            iov[1].iov_len = (size_t)len;
+            msg.msg_iovlen = 2;
+        }
+        if (msg.msg_iovlen == 1 || len < conn->reply_length)
+            flags = MSG_MORE; /* send_from_file() or more parts are next */
+    }
+
+    sent = sendmsg(conn->socket, &msg, flags);
+    if (sent > (ssize_t)iov[0].iov_len) {
+        const size_t body = (size_t)sent - iov[0].iov_len;
+
+        handle_send_header(conn, (ssize_t)iov[0].iov_len);
+        if (conn->shaped)
+            shape_charge(conn, (off_t)body);
+        handle_send_reply(conn, (ssize_t)body);
+        if (buf != NULL) {
+            buf->ofs += (off_t)body;
+            buf->start += body;
+            if ((buf->length -= body) == 0) {
+                send_buf_put(buf);
+                conn->send_buf = NULL;
+            }
+        }
+    }
+    else
+        handle_send_header(conn, sent);
+    return sent;
+}
+
+/* Sending header.  Assumes conn->header is not NULL. */
+static void poll_send_header(struct connection *conn) {
+    ssize_t sent;
+
+    assert(conn->state == SEND_HEADER);
+    assert(conn->header_length == strlen(conn->header));
+
+    /* The header is small, so there's no budget: keep going until it's all
+     * sent or the socket would block.
+     */
+    do {
+        sent = send_header_once(conn);
+    } while (sent > 0 && conn->state == SEND_HEADER && send_budget > 0);
+
+    /* go straight on to body, don't go through another iteration of the
+     * event loop.
+     */
+    if (conn->state == SEND_REPLY)
+        poll_send_reply(conn);
+}
+
+#ifndef min
+# define min(a,b) ( ((a)<(b)) ? (a) : (b) )
+#endif
+
+/* Send up to <size> bytes of reply_fd from <ofs> with pread() and send(),
+ * starting with anything left in the connection's buffer.  Stops early only
+ * if the socket is full.  Returns the number of bytes sent, or what send()
+ * returned if it sent nothing, or -1 on a read error.
+ */
+static ssize_t send_pread(struct connection *conn, const off_t ofs,
+        const size_t size) {
+    struct send_buf *buf = conn->send_buf;
+    size_t total = 0;
+
+    if (buf == NULL)
+        buf = conn->send_buf = send_buf_get();
+    else if (buf->length > 0 && buf->ofs != ofs)
+        buf->length = 0; /* not what's wanted, drop it */
+
+    while (total < size) {
+        size_t amount;
+        ssize_t sent;
+
+        if (buf->length == 0) {
+            ssize_t numread = pread(conn->reply_fd, buf->data,
+                min(sizeof(buf->data), size - total), ofs + (off_t)total);
+
+            if (numread == 0) {
+                fprintf(stderr, "premature eof on fd %d\n", conn->reply_fd);
+                return -1;
+            }
+            else if (numread == -1) {
+                fprintf(stderr, "error reading on fd %d: %s\n",
+                    conn->reply_fd, strerror(errno));
+                return -1;
+            }
+            buf->ofs = ofs + (off_t)total;
+            buf->start = 0;
+            buf->length = (size_t)numread;
+        }
+        amount = min(buf->length, size - total);
+        sent = send(conn->socket, buf->data + buf->start, amount, 0);
+        if (sent < 1)
+            return (total > 0) ? (ssize_t)total : sent;
+        buf->ofs += sent;
+        buf->start += (size_t)sent;
+        buf->length -= (size_t)sent;
+        total += (size_t)sent;
+        if ((size_t)sent < amount)
+            break; /* socket is full */
+    }
+    if (buf->length == 0) {
+        send_buf_put(buf);
+        conn->send_buf = NULL;
+    }
+    return (ssize_t)total;
+}
+
+#ifdef HAVE_SPLICE
+/* Give the connection its pipe for splicing file -> pipe -> socket. */
+static void open_pipe(struct connection *conn) {
+    if (pipe2(conn->pipe, O_CLOEXEC) == -1)
+        err(1, "pipe2()");
+    /* Bigger pipe, fewer trips around the loop.  This can fail
+     * (pipe-max-size) and that's fine.
+     */
+    fcntl(conn->pipe[1], F_SETPIPE_SZ, 1<<20);
+    conn->pipe_size = fcntl(conn->pipe[1], F_GETPIPE_SZ);
+    if (conn->pipe_size <= 0)
+        conn->pipe_size = 1<<16;
+    conn->pipe_pending = 0;
+}
+
+/* Like send_pread(), but moves the file through the connection's pipe
+ * without copying it.  Whatever the socket didn't take stays in the pipe.
+ */
+static ssize_t send_spliced(struct connection *conn, const off_t ofs,
+        const size_t size) {
+    size_t total = 0;
+
+    if (conn->pipe[0] == -1)
+        open_pipe(conn);
+    while (total < size) {
+        size_t amount;
+        ssize_t n;
+
+        if (conn->pipe_pending == 0) {
+            loff_t from = ofs + (off_t)total;
+
+            n = splice(conn->reply_fd, &from, conn->pipe[1], NULL,
+                min((size_t)conn->pipe_size, size - total),
+                SPLICE_F_NONBLOCK);
+            if (n == 0) {
+                fprintf(stderr, "premature eof on fd %d\n", conn->reply_fd);
+                return -1;
+            }
+            else if (n == -1) {
+                if (total > 0)
+                    break;
+                if (errno == EINVAL) {
+                    /* the file's filesystem can't splice */
+                    conn->send_fallback = 1;
+                    return send_pread(conn, ofs, size);
+                }
+                return -1;
+            }
+            conn->pipe_pending = (size_t)n;
+        }
+        amount = min(conn->pipe_pending, size - total);
+        n = splice(conn->pipe[0], NULL, conn->socket, NULL, amount,
+            SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+        if (n < 1)
+            return (total > 0) ? (ssize_t)total : n;
+        conn->pipe_pending -= (size_t)n;
+        total += (size_t)n;
+        if ((size_t)n < amount)
+            break; /* socket is full */
+    }
+    return (ssize_t)total;
+}
+#endif
+
+/* Send up to <size> bytes of the connection's reply_fd from <ofs> on its
+ * socket, the --send-method way.  Returns the number of bytes sent, 0 on
+ * closure, -1 if sending or reading failed.
+ */
+static ssize_t send_from_file(struct connection *conn, off_t ofs,
+        const size_t size) {
+    if (send_method == SEND_PREAD || conn->send_fallback)
+        return send_pread(conn, ofs, size);
+#ifdef HAVE_SPLICE
+    if (send_method == SEND_SPLICE)
+        return send_spliced(conn, ofs, size);
+#endif
+#ifdef __FreeBSD__
+    off_t sent;
+    int ret = sendfile(conn->reply_fd, conn->socket, ofs, size, NULL,
+        &sent, 0);
+
+    /* It is possible for sendfile to send zero bytes due to a blocking
+     * condition.  Handle this correctly.
+     */
+    if (ret == -1)
+        if (errno == EAGAIN)
+            if (sent == 0)
+                return -1;
+            else
+                return sent;
+        else if (errno == EOPNOTSUPP && sent == 0) {
+            conn->send_fallback = 1;
+            return send_pread(conn, ofs, size);
+        }
+        else
+            return -1;
+    else
+        return size;
+#elif defined(__linux) || defined(__sun__)
+    off_t from = ofs;
+    ssize_t sent = sendfile(conn->socket, conn->reply_fd, &from, size);
+
+    if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        /* e.g. some FUSE or overlay filesystems */
+        conn->send_fallback = 1;
+        return send_pread(conn, ofs, size);
+    }
+    return sent;
+#else
+    return send_pread(conn, ofs, size);
+#endif
+}
+
+/* Handle the outcome of sending part of the reply.  sent is what send() or
+ * send_from_file() returned.
+ */
+static void handle_send_reply(struct connection *conn, const ssize_t sent) {
+    if (debug)
+        printf("poll_send_reply(%d) sent %d: %llu+[%llu-%llu] of %llu\n",
+               conn->socket, (int)sent, llu(conn->reply_start),
+               llu(conn->reply_sent), llu(conn->reply_sent + sent - 1),
+               llu(conn->reply_length));
+
+    /* handle any errors (-1) or closure (0) in send() */
+    if (sent < 1) {
+        if (sent == -1) {
+            if (errno == EAGAIN) {
+                if (debug)
+                    printf("poll_send_reply would have blocked\n");
+                return;
+            }
+            if (debug)
+                printf("send(%d) error: %s\n", conn->socket, strerror(errno));
+        }
+        else if (sent == 0) {
+            if (debug)
+                printf("send(%d) closure\n", conn->socket);
+        }
+        conn->conn_close = 1;
+        conn->state = DONE;
+        return;
+    }
+    timer_set(conn, TIMER_SEND);
+    conn->reply_sent += sent;
+    conn->total_sent += (size_t)sent;
+    total_out += (size_t)sent;
+
+    /* check if we're done sending */
+    if (conn->reply_sent == conn->reply_length) {
+        conn->state = DONE;
+        send_stats_reply(conn);
+    }
+}
+
+/* Send the next piece of the reply, no more than max bytes of it.  Returns
+ * what send() or send_from_file() returned, and sets *full if the socket
+ * took less than it was offered.
+ */
+static ssize_t send_reply_once(struct connection *conn, const off_t max,
+        int *full)
+{
+    ssize_t sent;
+    const char *mem;
+    off_t ofs, send_len;
+
+    assert(conn->state == SEND_REPLY);
+    assert(!conn->header_only);
+    assert(conn->reply_length >= conn->reply_sent);
+    send_len = reply_segment(conn, &mem, &ofs);
+    if (send_len > max)
+        send_len = max;
+    if (mem != NULL) {
+        /* more to come after this part of a multipart reply */
+        const int flags = (conn->reply_sent + send_len < conn->reply_length) ?
+            MSG_MORE : 0;
+
+        sent = send(conn->socket, mem, (size_t)send_len, flags);
+    }
+    else {
+        errno = 0;
+        sent = send_from_file(conn, ofs, (size_t)send_len);
+        if (debug && (sent < 1))
+            printf("send_from_file returned %lld (errno=%d %s)\n",
+                (long long)sent, errno, strerror(errno));
+    }
+    *full = (sent > 0 && sent < send_len);
+    handle_send_reply(conn, sent);
+    return sent;
+}
+
+/* Sending reply: keep going until the socket is full or the connection has
+ * had its send_budget for this wakeup.  Each send is offered no more than
+ * is left of the budget.
+ */
+static void poll_send_reply(struct connection *conn)
+{
+    off_t budget = send_budget;
+    ssize_t sent;
+    int full;
+
+    do {
+        off_t max = (send_budget > 0 && budget < SEND_CHUNK) ?
+            budget : SEND_CHUNK;
+
+        if (conn->shaped && (max = shape_allowance(conn, max)) == 0)
+            return; /* parked */
+        sent = send_reply_once(conn, max, &full);
+        if (conn->shaped && sent < max)
+            shape_charge(conn, (sent > 0 ? sent : 0) - max);
+        if (sent < 1 || full)
+            return; /* would block, or failed */
+        budget -= sent;
+    } while (conn->state == SEND_REPLY && budget > 0);
+
+#ifdef HAVE_EPOLL
+    /* Still writable, but edge-triggered epoll won't say so again. */
+    if (conn->state == SEND_REPLY && send_budget > 0 &&
+            poller == POLLER_EPOLL && !conn->send_ready) {
+        LIST_INSERT_HEAD(&readylist, conn, ready_entries);
+        conn->send_ready = 1;
+    }
+#endif
+}
+
+#ifdef HAVE_EPOLL
+/* Make the epoll interest set for conn match its state.  Only costs a
+ * syscall when the state has switched between receiving and sending.
+ */
+static void epoll_update(struct connection *conn) {
+    struct epoll_event ev;
+    const uint32_t want = (conn->state == RECV_REQUEST) ? EPOLLIN :
+        (conn->timer == TIMER_SHAPE) ? EPOLLET : /* nothing while parked */
+        (send_budget > 0) ? (EPOLLOUT | EPOLLET) : EPOLLOUT;
+
+    if (conn->events == want)
+        return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = want;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  conn->socket, &ev) == -1)
+        err(1, "epoll_ctl(%d)", conn->socket);
+    conn->events = want;
+}
+#endif
+
+/* Advance a connection that the poller says is ready.  If that finishes it,
+ * either clean it out or recycle it for the next request.  Returns 0 if the
+ * connection was freed.
+ */
+static int poll_connection(struct connection *conn,
+        const int can_recv, const int can_send) {
+    switch (conn->state) {
+    case RECV_REQUEST:
+        if (can_recv) poll_recv_request(conn);
+        break;
+
+    case SEND_HEADER:
+        if (can_send) poll_send_header(conn);
+        break;
+
+    case SEND_REPLY:
+        if (can_send) poll_send_reply(conn);
+        break;
+
+    case DONE:
+        /* (handled below; ignore for now as it's a valid state) */
+        break;
+    }
+
+    /* Handling SEND_REPLY could have set the state to done. */
+    while (conn->state == DONE) {
+        /* clean out finished connection */
+        if (conn->conn_close) {
+            LIST_REMOVE(conn, entries);
+            free_connection(conn);
+            conn_pool_put(conn);
+            return 0;
+        }
+        recycle_connection(conn);
+        /* and go right back to recv_request, or to replying to a request
+         * that was pipelined behind the last one, without going through the
+         * event loop again.
+         */
+        if (conn->state == RECV_REQUEST)
+            poll_recv_request(conn);
+        else
+            poll_send_header(conn);
+    }
+#ifdef HAVE_EPOLL
+    if (poller == POLLER_EPOLL)
+        epoll_update(conn);
+#endif
+    return 1;
+}
+
+/* Connections with more of a reply to send are gathered over an iteration of
+ * the loop, then served shortest remaining reply first, so that small
+ * replies don't wait behind big downloads.
+ */
+static per_loop struct {
+    struct connection **conns;
+    size_t num, size;
+} sendq;
+
+static void sendq_add(struct connection *conn) {
+    if (sendq.num == sendq.size) {
+        sendq.size = sendq.size ? sendq.size * 2 : 64;
+        sendq.conns = xrealloc(sendq.conns,
+            sendq.size * sizeof(*sendq.conns));
+    }
+    sendq.conns[sendq.num++] = conn;
+}
+
+static int sendq_cmp(const void *a, const void *b) {
+    const struct connection *x = *(struct connection * const *)a,
+                            *y = *(struct connection * const *)b;
+    const off_t left_x = x->reply_length - x->reply_sent,
+                left_y = y->reply_length - y->reply_sent;
+
+    return (left_x > left_y) - (left_x < left_y);
+}
+
+static void sendq_run(void) {
+    size_t i;
+
+    if (sendq.num > 1)
+        qsort(sendq.conns, sendq.num, sizeof(*sendq.conns), sendq_cmp);
+    for (i = 0; i < sendq.num; i++)
+        poll_connection(sendq.conns[i], 0, 1);
+    sendq.num = 0;
+}
+
+/* Main loop of the httpd - a select() and then delegation to accept
+ * connections, handle receiving of requests, and sending of replies.
+ */
+static void httpd_poll_select(void) {
+    fd_set recv_set, send_set;
+    int max_fd, select_ret;
+    struct connection *conn, *next;
+    int wait_ms = timer_next_ms();
+    struct timespec timeout;
+    struct timeval t0, t1;
+
+    timeout.tv_sec = wait_ms / 1000;
+    timeout.tv_nsec = (long)(wait_ms % 1000) * 1000000;
+
+    FD_ZERO(&recv_set);
+    FD_ZERO(&send_set);
+    max_fd = 0;
+
+    /* set recv/send fd_sets */
+#define MAX_FD_SET(sock, fdset) do { FD_SET(sock,fdset); \
+                                max_fd = (max_fd<sock) ? sock : max_fd; } \
+                                while (0)
+    if (accepting) MAX_FD_SET(sockin, &recv_set);
+    if (file_cache.notify_fd != -1)
+        MAX_FD_SET(file_cache.notify_fd, &recv_set);
+
+    LIST_FOREACH_SAFE(conn, &connlist, entries, next) {
+        switch (conn->state) {
+        case DONE:
+            /* do nothing */
+            break;
+
+        case RECV_REQUEST:
+            MAX_FD_SET(conn->socket, &recv_set);
+            break;
+
+        case SEND_HEADER:
+        case SEND_REPLY:
+            if (conn->timer != TIMER_SHAPE)
+                MAX_FD_SET(conn->socket, &send_set);
+            break;
+        }
+    }
+#undef MAX_FD_SET
+
+#if defined(__has_feature)
+# if __has_feature(memory_sanitizer)
+    __msan_unpoison(&recv_set, sizeof(recv_set));
+    __msan_unpoison(&send_set, sizeof(send_set));
+# endif
+#endif
+
+    /* -select- */
+    if (debug) {
+        printf("select() with max_fd %d timeout %d ms\n", max_fd, wait_ms);
+        gettimeofday(&t0, NULL);
+    }
+    select_ret = pselect(max_fd + 1, &recv_set, &send_set, NULL,
+        (wait_ms >= 0) ? &timeout : NULL, &loop_sigmask);
+    if (select_ret == 0) {
+        if (wait_ms < 0)
+            errx(1, "select() timed out");
+    }
+    if (select_ret == -1) {
+        if (errno == EINTR)
+            return; /* interrupted by signal */
+        else
+            err(1, "select() failed");
+    }
+    if (debug) {
+        long long sec, usec;
+        gettimeofday(&t1, NULL);
+        sec = t1.tv_sec - t0.tv_sec;
+        usec = t1.tv_usec - t0.tv_usec;
+        if (usec < 0) {
+            usec += 1000000;
+            sec--;
+        }
+        printf("select() returned %d after %lld.%06lld secs\n",
+                select_ret, sec, usec);
+    }
+
+    /* update time */
+    update_clock();
+
+    /* poll connections that select() says need attention, after seeing to
+     * inotify, as in the epoll loop
+     */
+#ifdef HAVE_INOTIFY
+    if (file_cache.notify_fd != -1 &&
+            FD_ISSET(file_cache.notify_fd, &recv_set))
+        file_cache_notify();
+#endif
+    if (FD_ISSET(sockin, &recv_set))
+        accept_connection();
+
+    LIST_FOREACH_SAFE(conn, &connlist, entries, next) {
+        if (conn->state == SEND_REPLY) {
+            if (FD_ISSET(conn->socket, &send_set))
+                sendq_add(conn);
+            continue;
+        }
+        poll_connection(conn,
+            FD_ISSET(conn->socket, &recv_set),
+            FD_ISSET(conn->socket, &send_set));
+    }
+    sendq_run();
+    timers_run();
+}
+
+#ifdef HAVE_EPOLL
+/* Main loop of the httpd using epoll.  Connections register interest once
+ * and readiness is dispatched straight to the ready connection, so idle
+ * connections cost nothing per iteration.
+ */
+#define EPOLL_MAX_EVENTS 256
+static void httpd_poll_epoll(void) {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    struct connection *conn, *next;
+    int i, nfds, wait_ms;
+
+    /* keep sockin in the interest set only while we're accepting */
+    if (accepting != sockin_registered) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL; /* NULL means sockin */
+        if (epoll_ctl(epoll_fd, accepting ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                      sockin, &ev) == -1)
+            err(1, "epoll_ctl(sockin)");
+        sockin_registered = accepting;
+    }
+
+    wait_ms = timer_next_ms();
+    if (LIST_FIRST(&readylist) != NULL)
+        wait_ms = 0; /* there's sending to get on with */
+    if (debug)
+        printf("epoll_wait() with timeout %d ms\n", wait_ms);
+    nfds = epoll_pwait(epoll_fd, events, EPOLL_MAX_EVENTS, wait_ms,
+        &loop_sigmask);
+    if (nfds == -1) {
+        if (errno == EINTR)
+            return; /* interrupted by signal */
+        else
+            err(1, "epoll_wait() failed");
+    }
+    if (debug)
+        printf("epoll_wait() returned %d\n", nfds);
+
+    /* update time */
+    update_clock();
+
+#ifdef HAVE_INOTIFY
+    /* Files that changed before these requests came in must not be served
+     * from the cache to them, so see to inotify first.
+     */
+    for (i = 0; i < nfds; i++)
+        if (events[i].data.ptr == &file_cache)
+            file_cache_notify();
+#endif
+
+    for (i = 0; i < nfds; i++) {
+        const uint32_t ev = events[i].events;
+
+        conn = events[i].data.ptr;
+        if (conn == NULL) {
+            accept_connection();
+            continue;
+        }
+#ifdef HAVE_INOTIFY
+        if (events[i].data.ptr == &file_cache)
+            continue;
+#endif
+        /* Errors and hangups are reported through recv() or send(). */
+        if (conn->state == SEND_REPLY) {
+            /* (if it's on the readylist, it's about to be queued) */
+            if ((ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0 &&
+                    !conn->send_ready)
+                sendq_add(conn);
+            continue;
+        }
+        poll_connection(conn,
+            (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0,
+            (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0);
+    }
+
+    /* Carry on with connections that used up their send budget last time,
+     * along with the rest.  Any that use it up again go back on the list.
+     */
+    LIST_FOREACH_SAFE(conn, &readylist, ready_entries, next) {
+        LIST_REMOVE(conn, ready_entries);
+        conn->send_ready = 0;
+        sendq_add(conn);
+    }
+    sendq_run();
+    timers_run();
+}
+#endif
+
+#ifdef HAVE_IO_URING
+/* io_uring execution engine.  Instead of waiting for readiness and then
+ * making one syscall per step, accept, recv, send and file bodies (spliced
+ * file -> pipe -> socket) are queued as SQEs and submitted in one batch per
+ * loop iteration.  The ring is driven with raw syscalls so there's no
+ * dependency on liburing.
+ *
+ * A connection has at most one operation (or one linked chain) in flight,
+ * and is only advanced once all of its completions are in.  The kernel
+ * still owns the connection's buffers until then, so it must not be freed:
+ * to kill one early, shutdown() its socket and let the completions drain.
+ */
+#define URING_ENTRIES 256
+
+/* The low bits of user_data say which operation completed.  The rest is
+ * the connection, or NULL for operations on sockin.
+ */
+enum {
+    URING_ACCEPT, URING_RECV, URING_SEND_HEADER, URING_SEND_REPLY,
+    URING_SPLICE_IN, URING_SPLICE_OUT, URING_POLL_OUT, URING_NOTIFY
+};
+#define URING_TAG_MASK 7
+CTASSERT(URING_NOTIFY <= URING_TAG_MASK);
+
+static per_loop struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_size, sqes_size;
+    int accept_armed, accept_multishot;
+} uring = { .fd = -1 };
+
+static int uring_enter(const unsigned to_submit, const unsigned min_complete,
+        const unsigned flags, const void *arg, const size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, uring.fd, to_submit,
+        min_complete, flags, arg, argsz);
+}
+
+/* Number of SQEs queued but not yet consumed by the kernel. */
+static unsigned uring_pending(void) {
+    return *uring.sq_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Get a zeroed SQE, submitting what's queued first if the ring is full. */
+static struct io_uring_sqe *uring_get_sqe(const int tag,
+        const struct connection *conn) {
+    struct io_uring_sqe *sqe;
+    unsigned tail = *uring.sq_tail, idx;
+
+    if (uring_pending() == uring.sq_entries) {
+        if (uring_enter(uring.sq_entries, 0, 0, NULL, 0) == -1)
+            err(1, "io_uring_enter(submit)");
+    }
+    idx = tail & *uring.sq_mask;
+    sqe = &uring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)conn | (uint64_t)tag;
+    uring.sq_array[idx] = idx;
+    /* The kernel only looks at the SQ inside io_uring_enter(), so the SQE
+     * can be filled in after the tail is published.
+     */
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void uring_arm_accept(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(URING_ACCEPT, NULL);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockin;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (uring.accept_multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    uring.accept_armed = 1;
+}
+
+#ifdef HAVE_INOTIFY
+/* Wait for inotify to have something to say about the file cache. */
+static void uring_arm_notify(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(URING_NOTIFY, NULL);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = file_cache.notify_fd;
+    sqe->poll32_events = POLLIN;
+}
+#endif
+
+/* Set up the ring.  Returns 0 (with errno set, if it came from a syscall)
+ * if the kernel can't do everything we need.
+ */
+static int uring_init(void) {
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    size_t probe_size, sq_size, cq_size;
+    static const int ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SPLICE,
+        IORING_OP_POLL_ADD
+    };
+    const unsigned needed_features = IORING_FEAT_SINGLE_MMAP |
+        IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG;
+    unsigned i;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+    uring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (uring.fd == -1)
+        return 0;
+    if ((p.features & needed_features) != needed_features)
+        goto fail;
+
+    probe_size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    probe = xmalloc(probe_size);
+    memset(probe, 0, probe_size);
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PROBE,
+                probe, 256) == -1) {
+        free(probe);
+        goto fail;
+    }
+    for (i = 0; i < sizeof(ops) / sizeof(*ops); i++)
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            free(probe);
+            errno = ENOSYS;
+            goto fail;
+        }
+    free(probe);
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    uring.rings_size = (sq_size > cq_size) ? sq_size : cq_size;
+    uring.rings = mmap(NULL, uring.rings_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (uring.rings == MAP_FAILED)
+        goto fail;
+    uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        munmap(uring.rings, uring.rings_size);
+        goto fail;
+    }
+
+    sq = cq = uring.rings;
+    uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.sq_entries = p.sq_entries;
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    uring.accept_multishot = 1;
+    return 1;
+
+fail:
+    {
+        int saved_errno = errno;
+        close(uring.fd);
+        uring.fd = -1;
+        errno = saved_errno;
+    }
+    return 0;
+}
+
+static void uring_exit(void) {
+    /* Closing the ring cancels anything still in flight. */
+    munmap(uring.sqes, uring.sqes_size);
+    munmap(uring.rings, uring.rings_size);
+    xclose(uring.fd);
+    uring.fd = -1;
+}
+
+/* Give back to the rate limit buckets whatever a send or splice in didn't
+ * get through, of what was taken for it when it was queued.
+ */
+static void uring_refund(struct connection *conn, const int res) {
+    if (conn->shaped)
+        shape_charge(conn, (res > 0 ? res : 0) - conn->uring_charged);
+    conn->uring_charged = 0;
+}
+
+/* Queue the next operation for conn's current state. */
+static void uring_arm(struct connection *conn) {
+    struct io_uring_sqe *sqe;
+    const char *mem;
+    off_t ofs, len;
+
+    assert(conn->uring_inflight == 0);
+    switch (conn->state) {
+    case RECV_REQUEST:
+        sqe = uring_get_sqe(URING_RECV, conn);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->socket;
+        sqe->addr = (uint64_t)(uintptr_t)
+            (conn->request + conn->request_length);
+        sqe->len = (unsigned)(MAX_REQUEST_LENGTH - conn->request_length);
+        conn->uring_inflight = 1;
+        break;
+
+    case SEND_HEADER:
+        sqe = uring_get_sqe(URING_SEND_HEADER, conn);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->socket;
+        sqe->addr = (uint64_t)(uintptr_t)(conn->header + conn->header_sent);
+        sqe->len = (unsigned)(conn->header_length - conn->header_sent);
+        /* Hold the header back to go out with the start of the reply. */
+        if (!conn->header_only && conn->reply_length > 0)
+            sqe->msg_flags = MSG_MORE;
+        conn->uring_inflight = 1;
+        break;
+
+    case SEND_REPLY:
+        len = reply_segment(conn, &mem, &ofs);
+        if (conn->shaped && conn->pipe_pending == 0 &&
+                (len = shape_allowance(conn, len)) == 0)
+            break; /* parked */
+        if (mem != NULL) {
+            sqe = uring_get_sqe(URING_SEND_REPLY, conn);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->socket;
+            sqe->addr = (uint64_t)(uintptr_t)mem;
+            sqe->len = (unsigned)len;
+            if (conn->reply_sent + len < conn->reply_length)
+                sqe->msg_flags = MSG_MORE;
+            conn->uring_inflight = 1;
+            if (conn->shaped)
+                conn->uring_charged = len;
+            break;
+        }
+        if (conn->pipe[0] == -1)
+            open_pipe(conn);
+        /* splice() to a non-blocking socket doesn't wait for it to become
+         * writable, so do that first if the last splice would have blocked.
+         */
+        if (conn->uring_pollout) {
+            sqe = uring_get_sqe(URING_POLL_OUT, conn);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = conn->socket;
+            sqe->poll32_events = POLLOUT;
+            sqe->flags = IOSQE_IO_LINK;
+            conn->uring_inflight++;
+        }
+        if (conn->pipe_pending == 0) {
+            off_t chunk = len;
+
+            if (chunk > conn->pipe_size)
+                chunk = conn->pipe_size;
+            if (conn->shaped) {
+                shape_charge(conn, chunk - len);
+                conn->uring_charged = chunk;
+            }
+            sqe = uring_get_sqe(URING_SPLICE_IN, conn);
+            sqe->opcode = IORING_OP_SPLICE;
+            sqe->splice_fd_in = conn->reply_fd;
+            sqe->splice_off_in = (uint64_t)ofs;
+            sqe->fd = conn->pipe[1];
+            sqe->off = (uint64_t)-1;
+            sqe->len = (unsigned)chunk;
+            /* A short splice in breaks the link, and whatever made it into
+             * the pipe gets sent next time around.
+             */
+            sqe->flags = IOSQE_IO_LINK;
+            conn->uring_inflight++;
+            conn->pipe_pending = (size_t)chunk; /* at most */
+        }
+        sqe = uring_get_sqe(URING_SPLICE_OUT, conn);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = conn->pipe[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->fd = conn->socket;
+        sqe->off = (uint64_t)-1;
+        sqe->len = (unsigned)conn->pipe_pending;
+        conn->uring_inflight++;
+        break;
+
+    case DONE:
+        assert(0);
+        break;
+    }
+}
+
+/* Once all of conn's completions are in, clean it out, recycle it, or
+ * queue its next operation.
+ */
+static void uring_settle(struct connection *conn) {
+    if (conn->uring_inflight > 0)
+        return;
+    if (conn->state == DONE) {
+        if (conn->conn_close) {
+            LIST_REMOVE(conn, entries);
+            free_connection(conn);
+            conn_pool_put(conn);
+            return;
+        }
+        recycle_connection(conn);
+    }
+    uring_arm(conn);
+}
+
+/* Kill conn early: make its in-flight operations complete, then free it. */
+static void uring_close(struct connection *conn) {
+    assert(conn->state == DONE && conn->conn_close);
+    if (conn->uring_inflight > 0)
+        shutdown(conn->socket, SHUT_RDWR);
+    else
+        uring_settle(conn);
+}
+
+static void uring_accepted(const int fd) {
+    struct connection *conn;
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    num_accepts++;
+    conn = new_connection();
+    conn->socket = fd;
+    conn->state = RECV_REQUEST;
+
+    /* Multishot accept doesn't give us the address. */
+    memset(&addr, 0, sizeof(addr));
+    if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) == -1)
+        warn("getpeername()");
+#ifdef HAVE_INET6
+    if (inet6) {
+        conn->client = ((struct sockaddr_in6 *)&addr)->sin6_addr;
+    } else
+#endif
+    {
+        *(in_addr_t *)&conn->client =
+            ((struct sockaddr_in *)&addr)->sin_addr.s_addr;
+    }
+    LIST_INSERT_HEAD(&connlist, conn, entries);
+    timer_set(conn, TIMER_HEADER);
 
-    sent = send(conn->socket,
-                conn->header + conn->header_sent,
-                conn->header_length - conn->header_sent,
-                0);
-    conn->last_active = now;
     if (debug)
-        printf("poll_send_header(%d) sent %d bytes\n",
-               conn->socket, (int)sent);
+        printf("accepted connection from %s (fd %d)\n",
+               get_address_text(&conn->client), fd);
+    uring_arm(conn);
+}
 
-    /* handle any errors (-1) or closure (0) in send() */
-    if (sent < 1) {
-        if ((sent == -1) && (errno == EAGAIN)) {
-            if (debug) printf("poll_send_header would have blocked\n");
-            return;
-        }
-        if (debug && (sent == -1))
-            printf("send(%d) error: %s\n", conn->socket, strerror(errno));
-        conn->conn_close = 1;
-        conn->state = DONE;
-        return;
+static void uring_complete(const uint64_t user_data, const int res,
+        const unsigned flags) {
+    struct connection *conn =
+        (struct connection *)(uintptr_t)(user_data & ~(uint64_t)URING_TAG_MASK);
+    const int tag = (int)(user_data & URING_TAG_MASK);
+    ssize_t ret = res;
+
+    if (res < 0) {
+        errno = -res;
+        ret = -1;
     }
-    assert(sent > 0);
-    conn->header_sent += (size_t)sent;
-    conn->total_sent += (size_t)sent;
-    total_out += (size_t)sent;
 
-    /* check if we're done sending header */
-    if (conn->header_sent == conn->header_length) {
-        if (conn->header_only)
-            conn->state = DONE;
+    if (tag == URING_ACCEPT) {
+        if (!(flags & IORING_CQE_F_MORE))
+            uring.accept_armed = 0;
+        if (res >= 0)
+            uring_accepted(res);
+        else if (res == -EINVAL && uring.accept_multishot) {
+            /* Kernel is older than 5.19, go single-shot. */
+            uring.accept_multishot = 0;
+        }
         else {
-            conn->state = SEND_REPLY;
-            /* go straight on to body, don't go through another iteration of
-             * the select() loop.
+            /* Failed to accept, but try to keep serving existing
+             * connections.
              */
-            poll_send_reply(conn);
+            if (errno == EMFILE || errno == ENFILE) accepting = 0;
+            warn("accept()");
         }
+        return;
     }
-}
+#ifdef HAVE_INOTIFY
+    if (tag == URING_NOTIFY) {
+        file_cache_notify();
+        uring_arm_notify();
+        return;
+    }
+#endif
 
-/* Send chunk on socket <s> from FILE *fp, starting at <ofs> and of size
- * <size>.  Use sendfile() if possible since it's zero-copy on some platforms.
- * Returns the number of bytes sent, 0 on closure, -1 if send() failed, -2 if
- * read error.
- */
-static ssize_t send_from_file(const int s, const int fd,
-        off_t ofs, size_t size) {
-#ifdef __FreeBSD__
-    off_t sent;
-    int ret = sendfile(fd, s, ofs, size, NULL, &sent, 0);
+    assert(conn != NULL);
+    assert(conn->uring_inflight > 0);
+    conn->uring_inflight--;
 
-    /* It is possible for sendfile to send zero bytes due to a blocking
-     * condition.  Handle this correctly.
-     */
-    if (ret == -1)
-        if (errno == EAGAIN)
-            if (sent == 0)
-                return -1;
-            else
-                return sent;
+    /* An early close is waiting for this; don't touch the state. */
+    if (conn->state == DONE) {
+        uring_settle(conn);
+        return;
+    }
+
+    switch (tag) {
+    case URING_RECV:
+        handle_recv_request(conn, ret);
+        break;
+
+    case URING_SEND_HEADER:
+        handle_send_header(conn, ret);
+        break;
+
+    case URING_SEND_REPLY:
+        uring_refund(conn, res);
+        handle_send_reply(conn, ret);
+        break;
+
+    case URING_SPLICE_IN:
+        uring_refund(conn, res);
+        if (res <= 0) {
+            conn->pipe_pending = 0;
+            if (debug)
+                printf("splice from fd %d failed: %s\n", conn->reply_fd,
+                       res ? strerror(-res) : "premature eof");
+            conn->conn_close = 1;
+            conn->state = DONE;
+        }
         else
-            return -1;
-    else
-        return size;
-#else
-#if defined(__linux) || defined(__sun__)
-    /* Limit truly ridiculous (LARGEFILE) requests. */
-    if (size > 1<<20)
-        size = 1<<20;
-    return sendfile(s, fd, &ofs, size);
-#else
-    /* Fake sendfile() with read(). */
-# ifndef min
-#  define min(a,b) ( ((a)<(b)) ? (a) : (b) )
-# endif
-    char buf[1<<15];
-    size_t amount = min(sizeof(buf), size);
-    ssize_t numread;
-
-    if (lseek(fd, ofs, SEEK_SET) == -1)
-        err(1, "fseek(%d)", (int)ofs);
-    numread = read(fd, buf, amount);
-    if (numread == 0) {
-        fprintf(stderr, "premature eof on fd %d\n", fd);
-        return -1;
+            conn->pipe_pending = (size_t)res;
+        break;
+
+    case URING_SPLICE_OUT:
+        if (res == -ECANCELED)
+            break; /* the splice in came up short */
+        if (res == -EAGAIN)
+            conn->uring_pollout = 1;
+        if (res > 0)
+            conn->pipe_pending -= (size_t)res;
+        handle_send_reply(conn, ret);
+        break;
+
+    case URING_POLL_OUT:
+        conn->uring_pollout = 0;
+        break;
     }
-    else if (numread == -1) {
-        fprintf(stderr, "error reading on fd %d: %s", fd, strerror(errno));
-        return -1;
+    uring_settle(conn);
+}
+
+/* Main loop of the httpd using io_uring. */
+static void httpd_poll_uring(void) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail;
+    int wait_ms = timer_next_ms();
+    const uint64_t accepts_before = num_accepts;
+
+    if (accepting && !uring.accept_armed)
+        uring_arm_accept();
+
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask = (uint64_t)(uintptr_t)&loop_sigmask;
+    arg.sigmask_sz = _NSIG / 8; /* the kernel's sigset_t, not libc's */
+    if (wait_ms >= 0) {
+        ts.tv_sec = wait_ms / 1000;
+        ts.tv_nsec = (long long)(wait_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
     }
-    else if ((size_t)numread != amount) {
-        fprintf(stderr, "read %zd bytes, expecting %zu bytes on fd %d\n",
-            numread, amount, fd);
-        return -1;
+    if (debug)
+        printf("io_uring_enter() submitting %u\n", uring_pending());
+    if (uring_enter(uring_pending(), 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+            &arg, sizeof(arg)) == -1) {
+        if (errno == EINTR)
+            return; /* interrupted by signal */
+        else if (errno != ETIME && errno != EBUSY)
+            err(1, "io_uring_enter() failed");
     }
-    else
-        return send(s, buf, amount, 0);
-#endif
-#endif
-}
 
-/* Sending reply. */
-static void poll_send_reply(struct connection *conn)
-{
-    ssize_t sent;
-    /* off_t can be wider than size_t, avoid overflow in send_len */
-    const size_t max_size_t = ~((size_t)0);
-    off_t send_len = conn->reply_length - conn->reply_sent;
-    if (send_len > max_size_t) send_len = max_size_t;
+    /* update time */
+    update_clock();
 
-    assert(conn->state == SEND_REPLY);
-    assert(!conn->header_only);
-    if (conn->reply_type == REPLY_GENERATED) {
-        assert(conn->reply_length >= conn->reply_sent);
-        sent = send(conn->socket,
-            conn->reply + conn->reply_start + conn->reply_sent,
-            (size_t)send_len, 0);
+    head = *uring.cq_head;
+    tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    if (debug)
+        printf("io_uring_enter() reaped %u\n", tail - head);
+    while (head != tail) {
+        const struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        const uint64_t user_data = cqe->user_data;
+        const int res = cqe->res;
+        const unsigned flags = cqe->flags;
+
+        head++;
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        uring_complete(user_data, res, flags);
+        if (head == tail)
+            tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
     }
-    else {
-        errno = 0;
-        assert(conn->reply_length >= conn->reply_sent);
-        sent = send_from_file(conn->socket, conn->reply_fd,
-            conn->reply_start + conn->reply_sent, (size_t)send_len);
-        if (debug && (sent < 1))
-            printf("send_from_file returned %lld (errno=%d %s)\n",
-                (long long)sent, errno, strerror(errno));
+    if (num_accepts != accepts_before)
+        accept_wakeups++;
+    timers_run();
+}
+#endif
+
+/* Set up the chosen event loop backend. */
+static void init_poller(void) {
+    poller = poller_option;
+#ifdef HAVE_IO_URING
+    if (poller == POLLER_URING && !uring_init()) {
+        printf("io_uring not available (%s), falling back to epoll\n",
+            strerror(errno));
+        poller = POLLER_EPOLL;
     }
-    conn->last_active = now;
-    if (debug)
-        printf("poll_send_reply(%d) sent %d: %llu+[%llu-%llu] of %llu\n",
-               conn->socket, (int)sent, llu(conn->reply_start),
-               llu(conn->reply_sent), llu(conn->reply_sent + sent - 1),
-               llu(conn->reply_length));
+#endif
+#ifdef HAVE_EPOLL
+    if (poller == POLLER_EPOLL) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1)
+            err(1, "epoll_create1()");
+    }
+#endif
+    /* accept_connection() drains sockin until it would block.  (io_uring
+     * does its own waiting, and wants it blocking.)
+     */
+    if (poller != POLLER_URING)
+        nonblock_socket(sockin);
+}
 
-    /* handle any errors (-1) or closure (0) in send() */
-    if (sent < 1) {
-        if (sent == -1) {
-            if (errno == EAGAIN) {
-                if (debug)
-                    printf("poll_send_reply would have blocked\n");
-                return;
-            }
-            if (debug)
-                printf("send(%d) error: %s\n", conn->socket, strerror(errno));
-        }
-        else if (sent == 0) {
-            if (debug)
-                printf("send(%d) closure\n", conn->socket);
-        }
-        conn->conn_close = 1;
-        conn->state = DONE;
+/* Start watching cached files for changes, if there's a cache. */
+static void file_cache_init(void) {
+#ifdef HAVE_INOTIFY
+    if ((file_cache_size == 0 && fd_cache_max == 0) || !want_inotify)
+        return;
+    file_cache.notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (file_cache.notify_fd == -1) {
+        warn("inotify_init1(), checking cached files every %d seconds",
+            cache_ttl);
         return;
     }
-    conn->reply_sent += sent;
-    conn->total_sent += (size_t)sent;
-    total_out += (size_t)sent;
-
-    /* check if we're done sending */
-    if (conn->reply_sent == conn->reply_length)
-        conn->state = DONE;
+# ifdef HAVE_EPOLL
+    if (poller == POLLER_EPOLL) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &file_cache;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, file_cache.notify_fd,
+                      &ev) == -1)
+            err(1, "epoll_ctl(inotify)");
+    }
+# endif
+# ifdef HAVE_IO_URING
+    if (poller == POLLER_URING)
+        uring_arm_notify();
+# endif
+#endif
 }
 
-/* Main loop of the httpd - a select() and then delegation to accept
- * connections, handle receiving of requests, and sending of replies.
- */
+/* One iteration of the event loop. */
 static void httpd_poll(void) {
-    fd_set recv_set, send_set;
-    int max_fd, select_ret;
-    struct connection *conn, *next;
-    int bother_with_timeout = 0;
-    struct timeval timeout, t0, t1;
+    const uint64_t out = total_out;
 
-    timeout.tv_sec = timeout_secs;
-    timeout.tv_usec = 0;
+#ifdef HAVE_IO_URING
+    if (poller == POLLER_URING)
+        httpd_poll_uring();
+    else
+#endif
+#ifdef HAVE_EPOLL
+    if (poller == POLLER_EPOLL)
+        httpd_poll_epoll();
+    else
+#endif
+        httpd_poll_select();
 
-    FD_ZERO(&recv_set);
-    FD_ZERO(&send_set);
-    max_fd = 0;
+    if (total_out != out) {
+        send_stats.busy_iterations++;
+        if (send_stats.max_iteration_out < total_out - out)
+            send_stats.max_iteration_out = total_out - out;
+    }
+}
 
-    /* set recv/send fd_sets */
-#define MAX_FD_SET(sock, fdset) do { FD_SET(sock,fdset); \
-                                max_fd = (max_fd<sock) ? sock : max_fd; } \
-                                while (0)
-    if (accepting) MAX_FD_SET(sockin, &recv_set);
+/* Run an event loop until we're told to stop, then close and free
+ * everything that belongs to it.
+ */
+static void run_loop(void) {
+    struct connection *conn, *next;
 
-    LIST_FOREACH_SAFE(conn, &connlist, entries, next) {
-        switch (conn->state) {
-        case DONE:
-            /* do nothing */
-            break;
+    update_clock();
+    if (conn_prealloc > 0)
+        conn_pool_grow(conn_prealloc);
+    init_poller();
+    file_cache_init();
+    while (running) httpd_poll();
 
-        case RECV_REQUEST:
-            MAX_FD_SET(conn->socket, &recv_set);
-            bother_with_timeout = 1;
-            break;
+    xclose(sockin);
+    sockin = -1;
+#ifdef HAVE_EPOLL
+    if (epoll_fd != -1) xclose(epoll_fd);
+    epoll_fd = -1;
+#endif
+#ifdef HAVE_IO_URING
+    if (uring.fd != -1) uring_exit();
+#endif
 
-        case SEND_HEADER:
-        case SEND_REPLY:
-            MAX_FD_SET(conn->socket, &send_set);
-            bother_with_timeout = 1;
-            break;
-        }
+    /* close and free connections */
+    LIST_FOREACH_SAFE(conn, &connlist, entries, next) {
+        LIST_REMOVE(conn, entries);
+        free_connection(conn);
+        conn_pool_put(conn);
     }
-#undef MAX_FD_SET
-
-#if defined(__has_feature)
-# if __has_feature(memory_sanitizer)
-    __msan_unpoison(&recv_set, sizeof(recv_set));
-    __msan_unpoison(&send_set, sizeof(send_set));
-# endif
+    conn_pool_destroy();
+    send_buf_pool_destroy();
+    client_buckets_destroy();
+    free(sendq.conns);
+    sendq.conns = NULL;
+    sendq.num = sendq.size = 0;
+#ifdef HAVE_COMPRESS
+    compress_exit();
 #endif
+    file_cache_destroy();
+}
 
-    /* -select- */
-    if (debug) {
-        printf("select() with max_fd %d timeout %d\n",
-                max_fd, bother_with_timeout ? (int)timeout.tv_sec : 0);
-        gettimeofday(&t0, NULL);
+#ifdef HAVE_THREADS
+static void *loop_thread(void *arg) {
+    struct loop_thread *t = arg;
+
+    sockin = t->sockin;
+    run_loop();
+    t->num_requests = num_requests;
+    t->total_in = total_in;
+    t->total_out = total_out;
+    t->num_accepts = num_accepts;
+    t->accept_wakeups = accept_wakeups;
+    t->conn_pool_hits = conn_pool_hits;
+    t->conn_pool_allocs = conn_pool_allocs;
+    t->file_cache_hits = file_cache_hits;
+    t->file_cache_misses = file_cache_misses;
+    t->file_cache_evictions = file_cache_evictions;
+    t->send_stats = send_stats;
+
+    /* If the signal came to us, the main thread needs to hear about it too.
+     * It stays pending until the main thread next waits.
+     */
+    pthread_kill(threads[0].thread, SIGTERM);
+    return NULL;
+}
+
+/* Run num_threads event loops, using the main thread as the first one, and
+ * add up their counters once they've all stopped.
+ */
+static void run_threads(void) {
+    int i;
+
+    threads[0].thread = pthread_self();
+    for (i = 1; i < num_threads; i++) {
+        errno = pthread_create(&threads[i].thread, NULL, loop_thread,
+                               &threads[i]);
+        if (errno != 0)
+            err(1, "pthread_create()");
     }
-    select_ret = select(max_fd + 1, &recv_set, &send_set, NULL,
-        (bother_with_timeout) ? &timeout : NULL);
-    if (select_ret == 0) {
-        if (!bother_with_timeout)
-            errx(1, "select() timed out");
+    run_loop();
+    threads[0].num_requests = num_requests;
+    threads[0].total_in = total_in;
+    threads[0].total_out = total_out;
+    threads[0].num_accepts = num_accepts;
+    threads[0].accept_wakeups = accept_wakeups;
+    threads[0].conn_pool_hits = conn_pool_hits;
+    threads[0].conn_pool_allocs = conn_pool_allocs;
+    threads[0].file_cache_hits = file_cache_hits;
+    threads[0].file_cache_misses = file_cache_misses;
+    threads[0].file_cache_evictions = file_cache_evictions;
+    threads[0].send_stats = send_stats;
+
+    for (i = 1; i < num_threads; i++)
+        pthread_kill(threads[i].thread, SIGTERM);
+    for (i = 1; i < num_threads; i++) {
+        errno = pthread_join(threads[i].thread, NULL);
+        if (errno != 0)
+            err(1, "pthread_join()");
+        num_requests += threads[i].num_requests;
+        total_in += threads[i].total_in;
+        total_out += threads[i].total_out;
+        num_accepts += threads[i].num_accepts;
+        accept_wakeups += threads[i].accept_wakeups;
+        conn_pool_hits += threads[i].conn_pool_hits;
+        conn_pool_allocs += threads[i].conn_pool_allocs;
+        file_cache_hits += threads[i].file_cache_hits;
+        file_cache_misses += threads[i].file_cache_misses;
+        file_cache_evictions += threads[i].file_cache_evictions;
+        send_stats_add(&send_stats, &threads[i].send_stats);
     }
-    if (select_ret == -1) {
-        if (errno == EINTR)
-            return; /* interrupted by signal */
-        else
-            err(1, "select() failed");
+}
+#endif
+
+/* Start a worker in the given slot.  The child runs the event loop, leaves
+ * its counters in the slot and exits without going back through main().
+ */
+static void spawn_worker(struct worker *w) {
+    pid_t pid;
+
+    fflush(NULL); /* don't let the child inherit buffered output */
+    pid = fork();
+
+    if (pid == -1) {
+        warn("fork()");
+        return;
     }
-    if (debug) {
-        long long sec, usec;
-        gettimeofday(&t1, NULL);
-        sec = t1.tv_sec - t0.tv_sec;
-        usec = t1.tv_usec - t0.tv_usec;
-        if (usec < 0) {
-            usec += 1000000;
-            sec--;
-        }
-        printf("select() returned %d after %lld.%06lld secs\n",
-                select_ret, sec, usec);
+    if (pid == 0) {
+        if (signal(SIGCHLD, SIG_DFL) == SIG_ERR)
+            err(1, "signal(SIGCHLD)");
+        run_loop();
+        w->num_requests += num_requests;
+        w->total_in += total_in;
+        w->total_out += total_out;
+        w->num_accepts += num_accepts;
+        w->accept_wakeups += accept_wakeups;
+        w->conn_pool_hits += conn_pool_hits;
+        w->conn_pool_allocs += conn_pool_allocs;
+        w->file_cache_hits += file_cache_hits;
+        w->file_cache_misses += file_cache_misses;
+        w->file_cache_evictions += file_cache_evictions;
+        send_stats_add(&w->send_stats, &send_stats);
+        fflush(NULL);
+        _exit(EXIT_SUCCESS);
     }
+    w->pid = pid;
+    w->started = time(NULL);
+    printf("started worker %d\n", (int)pid);
+}
 
-    /* update time */
-    now = time(NULL);
-
-    /* poll connections that select() says need attention */
-    if (FD_ISSET(sockin, &recv_set))
-        accept_connection();
+static void child_exited(int sig unused) {
+    /* only here to interrupt pselect() */
+}
 
-    LIST_FOREACH_SAFE(conn, &connlist, entries, next) {
-        poll_check_timeout(conn);
-        switch (conn->state) {
-        case RECV_REQUEST:
-            if (FD_ISSET(conn->socket, &recv_set)) poll_recv_request(conn);
-            break;
+/* Supervise num_workers worker processes until told to stop, then pass the
+ * stop on to them and wait for them to finish.
+ */
+static void run_workers(void) {
+    sigset_t chld, wait_mask;
+    int i, alive;
+
+    workers = mmap(NULL, sizeof(*workers) * (size_t)num_workers,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (workers == MAP_FAILED)
+        err(1, "mmap(workers)");
+    memset(workers, 0, sizeof(*workers) * (size_t)num_workers);
+
+    /* Like the stop signals, SIGCHLD only gets through while waiting. */
+    if (signal(SIGCHLD, child_exited) == SIG_ERR)
+        err(1, "signal(SIGCHLD)");
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chld, NULL) == -1)
+        err(1, "sigprocmask()");
+    wait_mask = loop_sigmask;
+    sigdelset(&wait_mask, SIGCHLD);
+
+    for (i = 0; i < num_workers; i++)
+        spawn_worker(&workers[i]);
+
+    while (running) {
+        struct timespec delay, *timeout = NULL;
+        int status;
+        pid_t pid;
 
-        case SEND_HEADER:
-            if (FD_ISSET(conn->socket, &send_set)) poll_send_header(conn);
-            break;
+        /* Respawn dead workers, but if one died right after starting, it
+         * will probably do it again, so wait a second first.
+         */
+        now = time(NULL);
+        for (i = 0; i < num_workers; i++) {
+            if (workers[i].pid > 0)
+                continue;
+            if (now - workers[i].started >= 1)
+                spawn_worker(&workers[i]);
+            else {
+                delay.tv_sec = 1;
+                delay.tv_nsec = 0;
+                timeout = &delay;
+            }
+        }
 
-        case SEND_REPLY:
-            if (FD_ISSET(conn->socket, &send_set)) poll_send_reply(conn);
-            break;
+        if (pselect(0, NULL, NULL, NULL, timeout, &wait_mask) == -1 &&
+                errno != EINTR)
+            err(1, "pselect()");
 
-        case DONE:
-            /* (handled later; ignore for now as it's a valid state) */
-            break;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < num_workers; i++)
+                if (workers[i].pid == pid)
+                    break;
+            if (i == num_workers)
+                continue;
+            workers[i].pid = -1;
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "worker %d killed by signal %d (%s)\n",
+                    (int)pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
+            else if (running || WEXITSTATUS(status) != EXIT_SUCCESS)
+                fprintf(stderr, "worker %d exited with status %d\n",
+                    (int)pid, WEXITSTATUS(status));
         }
+    }
 
-        /* Handling SEND_REPLY could have set the state to done. */
-        if (conn->state == DONE) {
-            /* clean out finished connection */
-            if (conn->conn_close) {
-                LIST_REMOVE(conn, entries);
-                free_connection(conn);
-                free(conn);
-            } else {
-                recycle_connection(conn);
-                /* and go right back to recv_request without going through
-                 * select() again.
-                 */
-                poll_recv_request(conn);
+    /* pass the stop on */
+    for (i = 0; i < num_workers; i++)
+        if (workers[i].pid > 0)
+            kill(workers[i].pid, SIGTERM);
+    do {
+        alive = 0;
+        for (i = 0; i < num_workers; i++) {
+            if (workers[i].pid <= 0)
+                continue;
+            if (waitpid(workers[i].pid, NULL, 0) == -1 && errno == EINTR) {
+                alive = 1;
+                continue;
             }
+            workers[i].pid = -1;
         }
+    } while (alive);
+    xclose(sockin);
+
+    for (i = 0; i < num_workers; i++) {
+        num_requests += workers[i].num_requests;
+        total_in += workers[i].total_in;
+        total_out += workers[i].total_out;
+        num_accepts += workers[i].num_accepts;
+        accept_wakeups += workers[i].accept_wakeups;
+        conn_pool_hits += workers[i].conn_pool_hits;
+        conn_pool_allocs += workers[i].conn_pool_allocs;
+        file_cache_hits += workers[i].file_cache_hits;
+        file_cache_misses += workers[i].file_cache_misses;
+        file_cache_evictions += workers[i].file_cache_evictions;
+        send_stats_add(&send_stats, &workers[i].send_stats);
     }
 }
 
@@ -2717,16 +7091,29 @@ int main(int argc, char **argv) {
     printf("%s, %s.\n", pkgname, copyright);
     parse_default_extension_map();
     parse_commandline(argc, argv);
+    init_find_delim();
     /* parse_commandline() might override parts of the extension map by
      * parsing a user-specified file.
      */
     sort_mime_map();
     xasprintf(&keep_alive_field, "Keep-Alive: timeout=%d\r\n", timeout_secs);
     if (want_server_id)
-        xasprintf(&server_hdr, "Server: %s\r\n", pkgname);
+        server_hdr_len = xasprintf(&server_hdr, "Server: %s\r\n", pkgname);
     else
         server_hdr = xstrdup("");
     init_sockin();
+#ifdef HAVE_THREADS
+    if (num_threads > 1) {
+        int i;
+
+        threads = xmalloc(sizeof(*threads) * (size_t)num_threads);
+        memset(threads, 0, sizeof(*threads) * (size_t)num_threads);
+        threads[0].sockin = sockin;
+        for (i = 1; i < num_threads; i++)
+            threads[i].sockin = clone_sockin();
+        printf("running %d threads\n", num_threads);
+    }
+#endif
 
     /* open logfile */
     if (logfile_name == NULL)
@@ -2747,6 +7134,17 @@ int main(int argc, char **argv) {
         err(1, "signal(SIGINT)");
     if (signal(SIGTERM, stop_running) == SIG_ERR)
         err(1, "signal(SIGTERM)");
+    {
+        sigset_t stop_signals;
+
+        sigemptyset(&stop_signals);
+        sigaddset(&stop_signals, SIGINT);
+        sigaddset(&stop_signals, SIGTERM);
+        if (sigprocmask(SIG_BLOCK, &stop_signals, &loop_sigmask) == -1)
+            err(1, "sigprocmask()");
+        sigdelset(&loop_sigmask, SIGINT);
+        sigdelset(&loop_sigmask, SIGTERM);
+    }
 
     /* security */
     if (want_chroot) {
@@ -2779,24 +7177,19 @@ int main(int argc, char **argv) {
     if (want_daemon) daemonize_finish();
 
     /* main loop */
-    while (running) httpd_poll();
+    if (num_workers > 0)
+        run_workers();
+#ifdef HAVE_THREADS
+    else if (num_threads > 1)
+        run_threads();
+#endif
+    else
+        run_loop();
 
     /* clean exit */
-    xclose(sockin);
     if (logfile != NULL) fclose(logfile);
     if (pidfile_name) pidfile_remove();
 
-    /* close and free connections */
-    {
-        struct connection *conn, *next;
-
-        LIST_FOREACH_SAFE(conn, &connlist, entries, next) {
-            LIST_REMOVE(conn, entries);
-            free_connection(conn);
-            free(conn);
-        }
-    }
-
     /* free the mallocs */
     {
         size_t i;
@@ -2818,6 +7211,14 @@ int main(int argc, char **argv) {
         struct rusage r;
 
         getrusage(RUSAGE_SELF, &r);
+        if (num_workers > 0) {
+            /* include the workers */
+            struct rusage c;
+
+            getrusage(RUSAGE_CHILDREN, &c);
+            timeradd(&r.ru_utime, &c.ru_utime, &r.ru_utime);
+            timeradd(&r.ru_stime, &c.ru_stime, &r.ru_stime);
+        }
         printf("CPU time used: %u.%02u user, %u.%02u system\n",
             (unsigned int)r.ru_utime.tv_sec,
                 (unsigned int)(r.ru_utime.tv_usec/10000),
@@ -2826,6 +7227,50 @@ int main(int argc, char **argv) {
         );
         printf("Requests: %llu\n", llu(num_requests));
         printf("Bytes: %llu in, %llu out\n", llu(total_in), llu(total_out));
+        printf("Accepts: %llu in %llu wakeups (%.2f per wakeup)\n",
+            llu(num_accepts), llu(accept_wakeups), accept_wakeups ?
+            (double)num_accepts / (double)accept_wakeups : 0.0);
+        printf("Connection pool: %llu hits, %llu allocations\n",
+            llu(conn_pool_hits), llu(conn_pool_allocs));
+        if (file_cache_size > 0 || fd_cache_max > 0)
+            printf("File cache: %llu hits, %llu misses, %llu evictions\n",
+                llu(file_cache_hits), llu(file_cache_misses),
+                llu(file_cache_evictions));
+        {
+            const struct send_stats *ss = &send_stats;
+            int i;
+
+            for (i = 0; i < 2; i++)
+                printf("%s replies: %llu, %.1f ms average, %llu ms max\n",
+                    i ? "Large" : "Small", llu(ss->replies[i]),
+                    ss->replies[i] ?
+                    (double)ss->reply_ms[i] / (double)ss->replies[i] : 0.0,
+                    llu(ss->max_reply_ms[i]));
+            printf("Sent per busy iteration: %.0f bytes average, "
+                "%llu max\n", ss->busy_iterations ?
+                (double)total_out / (double)ss->busy_iterations : 0.0,
+                llu(ss->max_iteration_out));
+        }
+#ifdef HAVE_THREADS
+        if (num_threads > 1) {
+            int i;
+
+            printf("Requests per thread:");
+            for (i = 0; i < num_threads; i++)
+                printf(" %llu", llu(threads[i].num_requests));
+            printf("\n");
+        }
+        free(threads);
+#endif
+        if (num_workers > 0) {
+            int i;
+
+            printf("Requests per worker:");
+            for (i = 0; i < num_workers; i++)
+                printf(" %llu", llu(workers[i].num_requests));
+            printf("\n");
+            munmap(workers, sizeof(*workers) * (size_t)num_workers);
+        }
     }
 
     return 0;
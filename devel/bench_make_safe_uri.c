@@ -0,0 +1,194 @@
+/* Benchmark make_safe_url() against the three steps it replaced: strchr()
+ * for the query string, urldecode() into a new string, make_safe_url() on
+ * that, then xasprintf() to put wwwroot in front.  Both are checked to give
+ * the same answers on random URLs first.
+ *
+ * cc -O2 bench_make_safe_uri.c -o bench_make_safe_uri && ./bench_make_safe_uri
+ */
+#define main _main_disabled_
+#include "../darkhttpd.c"
+#undef main
+
+/* [->] the old versions */
+static char *old_urldecode(const char *url) {
+    size_t i, pos, len = strlen(url);
+    char *out = xmalloc(len+1);
+
+    for (i = 0, pos = 0; i < len; i++) {
+        if ((url[i] == '%') && (i+2 < len) &&
+            isxdigit(url[i+1]) && isxdigit(url[i+2])) {
+            /* decode %XX */
+#define HEX_TO_DIGIT(hex) ( \
+    ((hex) >= 'A' && (hex) <= 'F') ? ((hex)-'A'+10): \
+    ((hex) >= 'a' && (hex) <= 'f') ? ((hex)-'a'+10): \
+    ((hex)-'0') )
+
+            out[pos++] = HEX_TO_DIGIT(url[i+1]) * 16 +
+                         HEX_TO_DIGIT(url[i+2]);
+            i += 2;
+#undef HEX_TO_DIGIT
+        } else {
+            /* straight copy */
+            out[pos++] = url[i];
+        }
+    }
+    out[pos] = '\0';
+    return out;
+}
+
+static char *old_make_safe_url(char *const url) {
+    char *src = url, *dst;
+    #define ends(c) ((c) == '/' || (c) == '\0')
+
+    /* URLs not starting with a slash are illegal. */
+    if (*src != '/')
+        return NULL;
+
+    /* Fast case: skip until first double-slash or dot-dir. */
+    for ( ; *src; ++src) {
+        if (*src == '/') {
+            if (src[1] == '/')
+                break;
+            else if (src[1] == '.') {
+                if (ends(src[2]))
+                    break;
+                else if (src[2] == '.' && ends(src[3]))
+                    break;
+            }
+        }
+    }
+
+    /* Copy to dst, while collapsing multi-slashes and handling dot-dirs. */
+    dst = src;
+    while (*src) {
+        if (*src != '/')
+            *dst++ = *src++;
+        else if (*++src == '/')
+            ;
+        else if (*src != '.')
+            *dst++ = '/';
+        else if (ends(src[1]))
+            /* Ignore single-dot component. */
+            ++src;
+        else if (src[1] == '.' && ends(src[2])) {
+            /* Double-dot component. */
+            src += 2;
+            if (dst == url)
+                return NULL; /* Illegal URL */
+            else
+                /* Backtrack to previous slash. */
+                while (*--dst != '/' && dst > url);
+        }
+        else
+            *dst++ = '/';
+    }
+
+    if (dst == url)
+        ++dst;
+    *dst = '\0';
+    return url;
+    #undef ends
+}
+/* [<-] */
+
+static const char root[] = "/var/www/htdocs";
+
+/* Returns the full path, or NULL if the URL is unsafe. */
+static char *old_pipeline(char *url) {
+    char *end, *decoded, *target;
+
+    if ((end = strchr(url, '?')) != NULL)
+        *end = '\0';
+    decoded = old_urldecode(url);
+    if (old_make_safe_url(decoded) == NULL) {
+        free(decoded);
+        return NULL;
+    }
+    xasprintf(&target, "%s%s", root, decoded);
+    free(decoded);
+    return target;
+}
+
+static char *new_pipeline(char *url, char *target) {
+    memcpy(target, root, sizeof(root) - 1);
+    if (make_safe_url(url, target + sizeof(root) - 1) == NULL)
+        return NULL;
+    return target;
+}
+
+static void check(unsigned int seed) {
+    static const char *pieces[] = {
+        "/", "//", ".", "..", "a", "bc", "%2e", "%2E", "%2f", "%2F",
+        "%41", "%4", "%", "%g1", "%00", "?", "%3f", "x.y", "...",
+    };
+    const size_t num_pieces = sizeof(pieces) / sizeof(*pieces);
+    char url[256], url2[256], target[sizeof(root) + 256];
+    char *a, *b;
+    int i, n;
+
+    srand(seed);
+    for (n = 0; n < 1000000; n++) {
+        url[0] = '\0';
+        for (i = rand() % 12; i >= 0; i--)
+            strcat(url, pieces[(size_t)rand() % num_pieces]);
+        strcpy(url2, url);
+        a = old_pipeline(url);
+        b = new_pipeline(url2, target);
+        if ((a == NULL) != (b == NULL) || (a && strcmp(a, b) != 0) ||
+                strcmp(url, url2) != 0)
+            errx(1, "mismatch on \"%s\": \"%s\" vs \"%s\"",
+                url, a ? a : "(unsafe)", b ? b : "(unsafe)");
+        free(a);
+    }
+}
+
+static double elapsed(const struct timespec *t0) {
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (double)(t1.tv_sec - t0->tv_sec) +
+           (double)(t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* What browsers tend to ask for. */
+static const char *urls[] = {
+    "/",
+    "/index.html",
+    "/static/js/app.3f9c2a7e.min.js",
+    "/images/hero-banner@2x.jpg?v=1697400000",
+    "/docs/guide/getting%20started/installing%20on%20linux.html",
+    "/downloads/release-1.13/../release-1.14/darkhttpd-1.14.tar.gz",
+    "/search/results.html?q=web+server&lang=en&page=2#top",
+    "/%E6%96%87%E6%A1%A3/%E6%8C%87%E5%8D%97.html",
+};
+#define NUM_URLS (sizeof(urls) / sizeof(*urls))
+#define ITERATIONS 5000000
+
+int main(void) {
+    char url[256], target[sizeof(root) + 256];
+    struct timespec t0;
+    double t_old, t_new;
+    size_t i;
+
+    check(1);
+    printf("old and new agree on 1000000 random URLs\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < ITERATIONS; i++) {
+        strcpy(url, urls[i % NUM_URLS]);
+        free(old_pipeline(url));
+    }
+    t_old = elapsed(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < ITERATIONS; i++) {
+        strcpy(url, urls[i % NUM_URLS]);
+        if (new_pipeline(url, target) == NULL)
+            abort();
+    }
+    t_new = elapsed(&t0);
+
+    printf("old: %6.1f ns/url\nnew: %6.1f ns/url (%.1fx)\n",
+        t_old * 1e9 / ITERATIONS, t_new * 1e9 / ITERATIONS, t_old / t_new);
+    return 0;
+}
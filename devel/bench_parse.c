@@ -0,0 +1,142 @@
+/* Microbenchmark for request parsing: how many browser-sized requests one
+ * core can take through find_header_end() and parse_request(), with each
+ * find_delim() kernel this machine can run.
+ *
+ * cc -O2 bench_parse.c -o bench_parse && ./bench_parse [seconds]
+ */
+#define main _main_disabled_
+#include "../darkhttpd.c"
+#undef main
+
+/* Roughly what current browsers send for a page load, a subresource and a
+ * revalidation.  Between 500 and 1500 bytes each.
+ */
+static const char *requests[] = {
+    "GET /docs/guide/getting-started.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", "
+        "\"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+        "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 "
+        "Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/avif,image/webp,image/apng,*/*;q=0.8,"
+        "application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: https://www.example.com/docs/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+    "Cookie: _ga=GA1.2.1234567890.1697000000; "
+        "_gid=GA1.2.987654321.1697400000; theme=dark; "
+        "session=4f9c2a7e1b3d5f60718293a4b5c6d7e8\r\n"
+    "\r\n",
+
+    "GET /static/css/site.min.css?v=3.2.1 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+        "Gecko/20100101 Firefox/118.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: https://www.example.com/docs/guide/getting-started.html\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n",
+
+    "GET /images/hero-banner@2x.jpg HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Accept: image/webp,image/avif,image/jxl,image/heic,image/heic-sequence,"
+        "video/*;q=0.8,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Connection: keep-alive\r\n"
+    "If-Modified-Since: Mon, 09 Oct 2023 14:12:45 GMT\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) "
+        "AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.0 "
+        "Safari/605.1.15\r\n"
+    "Accept-Language: en-GB,en;q=0.9\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Range: bytes=0-65535\r\n"
+    "Cookie: _ga=GA1.2.1234567890.1697000000; "
+        "_gid=GA1.2.987654321.1697400000; theme=dark; "
+        "session=4f9c2a7e1b3d5f60718293a4b5c6d7e8; "
+        "consent=analytics%3Dtrue%26ads%3Dfalse; "
+        "recently_viewed=guide%2Cfaq%2Cdownloads%2Cchangelog; "
+        "ab_bucket=7; tz=Europe%2FLondon\r\n"
+    "\r\n",
+};
+#define NUM_REQUESTS (sizeof(requests) / sizeof(*requests))
+
+static double elapsed(const struct timespec *t0) {
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (double)(t1.tv_sec - t0->tv_sec) +
+           (double)(t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void bench(const char *name, find_delim_fn *fn, const double secs) {
+    struct connection *conn = new_connection();
+    size_t lengths[NUM_REQUESTS], i, bytes = 0;
+    unsigned long n = 0;
+    struct timespec t0;
+    double t;
+
+    for (i = 0; i < NUM_REQUESTS; i++) {
+        lengths[i] = strlen(requests[i]);
+        if (lengths[i] > MAX_REQUEST_LENGTH)
+            errx(1, "request %zu is too long", i);
+    }
+
+    find_delim = fn;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    do {
+        int batch;
+
+        for (batch = 0; batch < 10000; batch++, n++) {
+            i = n % NUM_REQUESTS;
+            arena_reset(&conn->arena);
+            reset_request(conn);
+            memcpy(conn->request, requests[i], lengths[i]);
+            conn->request_length = lengths[i];
+            conn->request_length = find_header_end(conn);
+            conn->request[conn->request_length] = '\0';
+            if (conn->request_length != lengths[i] || !parse_request(conn))
+                errx(1, "%s: failed to parse request %zu", name, i);
+            bytes += conn->request_length;
+        }
+    } while ((t = elapsed(&t0)) < secs);
+
+    printf("%-8s %10.0f req/s  %7.1f MB/s\n",
+        name, (double)n / t, (double)bytes / t / 1e6);
+    free_connection(conn);
+}
+
+int main(int argc, char **argv) {
+    const double secs = (argc > 1) ? atof(argv[1]) : 1.0;
+    size_t i, total = 0;
+
+    for (i = 0; i < NUM_REQUESTS; i++)
+        total += strlen(requests[i]);
+    printf("%zu requests, %zu bytes on average, %.1f s per kernel\n",
+        NUM_REQUESTS, total / NUM_REQUESTS, secs);
+
+    bench("scalar", find_delim_scalar, secs);
+#ifdef HAVE_SSE2
+    bench("sse2", find_delim_sse2, secs);
+#endif
+#ifdef HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        bench("avx2", find_delim_avx2, secs);
+#endif
+    return 0;
+}
@@ -1,7 +1,5 @@
 // Wrapper around make_safe_url() for fuzzing.
 // Aborts if the output is deemed safe but contains /../ or /./
-#include <stdio.h>
-
 #define main _main_disabled_
 #include "../darkhttpd.c"
 #undef main
@@ -15,7 +13,7 @@ int main(void) {
     if (l > 0) {
         buf[l-1] = '\0';
     }
-    char* safe = make_safe_url(buf);
+    char* safe = make_safe_url(buf, buf);
     if (safe) {
         if (strstr(safe, "/../") != NULL) abort();
         if (strstr(safe, "/./") != NULL) abort();
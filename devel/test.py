@@ -6,6 +6,9 @@ import signal
 import re
 import os
 import random
+import time
+import datetime
+import email.utils
 
 WWWROOT = "tmp.httpd.tests"
 
@@ -331,10 +334,135 @@ class TestFileGet(TestHelper):
         self.assertFalse("Content-Length" in hdrs)
         self.assertFalse("Content-Type" in hdrs)
 
+    def test_if_modified_since_unreadable(self):
+        # No 304 (or ETag) for a file that wouldn't be served.
+        resp1 = self.get(self.url, method="HEAD")
+        status, hdrs, body = parse(resp1)
+        os.chmod(self.fn, 0)
+        resp2 = self.get(self.url, req_hdrs = {
+            "If-Modified-Since": hdrs["Last-Modified"],
+            "If-None-Match": hdrs["ETag"]})
+        os.chmod(self.fn, 0o644)
+        status, hdrs, body = parse(resp2)
+        self.assertContains(status, "403 Forbidden")
+        self.assertForbidden(body, self.url)
+        self.assertFalse("ETag" in hdrs)
+
+    def test_if_modified_since_lowercase(self):
+        resp1 = self.get(self.url, method="HEAD")
+        status, hdrs, body = parse(resp1)
+        lastmod = hdrs["Last-Modified"]
+
+        resp2 = self.get(self.url, method="GET", req_hdrs =
+            {"if-modified-since": lastmod })
+        status, hdrs, body = parse(resp2)
+        self.assertContains(status, "304 Not Modified")
+
+    def test_if_modified_since_formats(self):
+        status, hdrs, body = parse(self.get(self.url, method="HEAD"))
+        t = email.utils.parsedate_to_datetime(hdrs["Last-Modified"])
+        for fmt in ["%A, %d-%b-%y %H:%M:%S GMT", "%a %b %e %H:%M:%S %Y"]:
+            for delta, code in [(0, "304 Not Modified"), (3600,
+                    "304 Not Modified"), (-1, "200 OK")]:
+                since = (t + datetime.timedelta(seconds=delta)).strftime(fmt)
+                resp = self.get(self.url,
+                    req_hdrs = {"If-Modified-Since": since})
+                status, hdrs, body = parse(resp)
+                self.assertContains(status, code)
+
+    def test_if_modified_since_garbage(self):
+        resp = self.get(self.url,
+            req_hdrs = {"If-Modified-Since": "Sun, 06 Nov 1994 08:49:37 XYZ"})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "200 OK")
+
+    def test_etag(self):
+        status, hdrs, body = parse(self.get(self.url, method="HEAD"))
+        etag = hdrs["ETag"]
+        self.assertTrue(etag.startswith('"') and etag.endswith('"'))
+        for inm, code in [
+                (etag, "304 Not Modified"),
+                ('"nope", ' + etag, "304 Not Modified"),
+                ("W/" + etag, "304 Not Modified"),
+                ("*", "304 Not Modified"),
+                ('"nope"', "200 OK"),
+                (etag[:-1] + 'x"', "200 OK"),
+                ]:
+            resp = self.get(self.url, req_hdrs = {"If-None-Match": inm})
+            status, hdrs, body = parse(resp)
+            self.assertContains(status, code)
+            if code.startswith("304"):
+                self.assertEqual(hdrs["ETag"], etag)
+
+    def test_etag_wins_over_date(self):
+        status, hdrs, body = parse(self.get(self.url, method="HEAD"))
+        resp = self.get(self.url, req_hdrs = {"If-None-Match": '"nope"',
+            "If-Modified-Since": hdrs["Last-Modified"]})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "200 OK")
+
+    def test_etag_changes(self):
+        status, hdrs, body = parse(self.get(self.url, method="HEAD"))
+        etag = hdrs["ETag"]
+        with open(self.fn, 'ab') as f:
+            f.write(b"more")
+        time.sleep(0.1) # for inotify, with a file cache
+        resp = self.get(self.url, req_hdrs = {"If-None-Match": etag})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "200 OK")
+        self.assertNotEqual(hdrs["ETag"], etag)
+
+    def test_if_range(self):
+        status, hdrs, body = parse(self.get(self.url, method="HEAD"))
+        for if_range, code in [
+                (hdrs["ETag"], "206 Partial Content"),
+                (hdrs["Last-Modified"], "206 Partial Content"),
+                ("W/" + hdrs["ETag"], "200 OK"),
+                ('"nope"', "200 OK"),
+                ("Sun, 06 Nov 1994 08:49:37 GMT", "200 OK"),
+                ]:
+            resp = self.get(self.url, req_hdrs = {"Range": "bytes=5-9",
+                "If-Range": if_range})
+            status, hdrs2, body = parse(resp)
+            self.assertContains(status, code)
+            self.assertEqual(body,
+                self.data[5:10] if code.startswith("206") else self.data)
+
+    def test_if_range_rewritten_same_second(self):
+        # Same inode, same size, same second: still a different version.
+        while time.time() % 1 > 0.5:
+            time.sleep(0.05)
+        with open(self.fn, 'wb') as f:
+            f.write(self.data)
+        status, hdrs, body = parse(self.get(self.url, method="HEAD"))
+        time.sleep(0.05)
+        data = random_bytes(self.datalen)
+        with open(self.fn, 'wb') as f:
+            f.write(data)
+        resp = self.get(self.url, req_hdrs = {"Range": "bytes=5-9",
+            "If-Range": hdrs["ETag"]})
+        status, hdrs2, body = parse(resp)
+        self.assertNotEqual(hdrs2["ETag"], hdrs["ETag"])
+        self.assertContains(status, "200 OK")
+        self.assertEqual(body, data)
+
     def test_range_single(self):
         self.drive_range("5-5", "5-5/%d" % self.datalen,
                 1, self.data[5:6])
 
+    def test_range_lowercase(self):
+        resp = self.get(self.url, req_hdrs = {"range": "bytes=5-5"})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "206 Partial Content")
+        self.assertEqual(body, self.data[5:6])
+
+    def test_range_in_other_field(self):
+        # Only a Range field counts, not the text in another field's value.
+        resp = self.get(self.url, req_hdrs = {"X-Note": "Range: bytes=5-5"})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "200 OK")
+        self.assertEqual(body, self.data)
+
     def test_range_single_first(self):
         self.drive_range("0-0", "0-0/%d" % self.datalen,
                 1, self.data[0:1])
@@ -386,6 +514,84 @@ class TestFileGet(TestHelper):
         status, hdrs, body = parse(resp)
         self.assertContains(status, "416 Requested Range Not Satisfiable")
 
+    def get_multipart(self, ranges):
+        """Returns a list of (Content-Range, data) for each part."""
+        resp = self.get(self.url, req_hdrs = {"Range": "bytes=" + ranges})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "206 Partial Content")
+        self.assertEqual(hdrs["Content-Length"], str(len(body)))
+        ctype, boundary = hdrs["Content-Type"].split("; boundary=")
+        self.assertEqual(ctype, "multipart/byteranges")
+        delim = b"--" + boundary.encode()
+        self.assertTrue(body.startswith(delim + b"\r\n"))
+        self.assertTrue(body.endswith(b"\r\n" + delim + b"--\r\n"))
+        parts = []
+        for part in body[len(delim)+2:-len(delim)-6].split(
+                b"\r\n" + delim + b"\r\n"):
+            head, data = part.split(b"\r\n\r\n", 1)
+            fields = dict(line.decode().split(": ", 1)
+                          for line in head.split(b"\r\n"))
+            self.assertEqual(fields["Content-Type"], "image/jpeg")
+            parts.append((fields["Content-Range"], data))
+        return parts
+
+    def test_range_multiple(self):
+        n = self.datalen
+        parts = self.get_multipart("0-9, 100-199,-10")
+        self.assertEqual(parts, [
+            ("bytes 0-9/%d" % n, self.data[0:10]),
+            ("bytes 100-199/%d" % n, self.data[100:200]),
+            ("bytes %d-%d/%d" % (n-10, n-1, n), self.data[-10:]),
+            ])
+
+    def test_range_multiple_sorted(self):
+        n = self.datalen
+        parts = self.get_multipart("2000-, 50-59 ,10-19,%d-" % (n*2))
+        self.assertEqual(parts, [
+            ("bytes 10-19/%d" % n, self.data[10:20]),
+            ("bytes 50-59/%d" % n, self.data[50:60]),
+            ("bytes 2000-%d/%d" % (n-1, n), self.data[2000:]),
+            ])
+
+    def test_range_multiple_coalesced(self):
+        # Overlapping and adjacent ranges are merged into one.
+        n = self.datalen
+        parts = self.get_multipart("10-19,15-29,30-39,1000-1009")
+        self.assertEqual(parts, [
+            ("bytes 10-39/%d" % n, self.data[10:40]),
+            ("bytes 1000-1009/%d" % n, self.data[1000:1010]),
+            ])
+        self.drive_range("10-19,20-29,15-25",
+            "10-29/%d" % n, 20, self.data[10:30])
+
+    def test_range_multiple_unsatisfiable(self):
+        resp = self.get(self.url, req_hdrs = {"Range": "bytes=%d-,%d-%d"%(
+            self.datalen, self.datalen*2, self.datalen*3)})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "416 Requested Range Not Satisfiable")
+
+    def test_range_multiple_too_many(self):
+        ranges = ",".join("%d-%d" % (i*10, i*10) for i in range(100))
+        resp = self.get(self.url, req_hdrs = {"Range": "bytes=" + ranges})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "200 OK")
+        self.assertEqual(body, self.data)
+
+    def test_range_multiple_bad(self):
+        # One bad range spoils the lot.
+        resp = self.get(self.url, req_hdrs = {"Range": "bytes=5-5, junk"})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "200 OK")
+        self.assertEqual(body, self.data)
+
+    def test_range_multiple_head(self):
+        resp = self.get(self.url, method="HEAD",
+            req_hdrs = {"Range": "bytes=0-9,20-29"})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "206 Partial Content")
+        self.assertContains(hdrs["Content-Type"], "multipart/byteranges")
+        self.assertEqual(body, b"")
+
 class TestKeepAlive(TestFileGet):
     """
     Run all of TestFileGet but with a single long-lived connection.
@@ -400,6 +606,115 @@ class TestKeepAlive(TestFileGet):
     def get(self, url, endl="\n", req_hdrs={}, method="GET"):
         return self.conn.get_keepalive(url, endl, req_hdrs, method)
 
+class TestPipelining(TestHelper):
+    """
+    Several requests sent back to back, without waiting for the replies.
+    """
+    def setUp(self):
+        self.data = random_bytes(100)
+        self.url = '/pipelined.bin'
+        self.fn = WWWROOT + self.url
+        with open(self.fn, 'wb') as f:
+            f.write(self.data)
+
+    def tearDown(self):
+        os.unlink(self.fn)
+
+    def request(self, first, last, close=False):
+        return ("GET %s HTTP/1.1\r\n"
+                "Range: bytes=%d-%d\r\n"
+                "Connection: %s\r\n"
+                "\r\n" % (self.url, first, last,
+                           "close" if close else "keep-alive")).encode()
+
+    def pipeline(self, *chunks):
+        """
+        Send each chunk separately, then return the list of responses.
+        """
+        c = Conn()
+        for chunk in chunks:
+            c.s.send(chunk)
+            time.sleep(0.01)
+        ret = b''
+        while True:
+            signal.alarm(1) # don't wait forever
+            r = c.s.recv(65536)
+            signal.alarm(0)
+            if r == b'':
+                break
+            ret += r
+        c.close()
+        responses = []
+        while ret:
+            p = ret.index(b'\r\n\r\n') + 4
+            cl = int(between(ret, b'Content-Length: ', b'\r\n'))
+            responses.append(parse(ret[:p + cl]))
+            ret = ret[p + cl:]
+        return responses
+
+    def assertRanges(self, responses, *ranges):
+        self.assertEqual(len(responses), len(ranges))
+        for (status, hdrs, body), (first, last) in zip(responses, ranges):
+            self.assertContains(status, "206 Partial Content")
+            self.assertEqual(body, self.data[first:last+1])
+
+    def test_pipelined_in_one_send(self):
+        self.assertRanges(self.pipeline(
+            self.request(0, 9) + self.request(10, 19) +
+            self.request(20, 29, close=True)),
+            (0, 9), (10, 19), (20, 29))
+
+    def test_pipelined_split(self):
+        second = self.request(10, 19, close=True)
+        self.assertRanges(self.pipeline(
+            self.request(0, 9) + second[:7], second[7:]),
+            (0, 9), (10, 19))
+
+    def test_body_closes(self):
+        responses = self.pipeline(
+            b"POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello" +
+            self.request(0, 9, close=True))
+        self.assertEqual(len(responses), 1)
+        self.assertContains(responses[0][0], "501 Not Implemented")
+
+class TestBusySending(TestHelper):
+    """
+    Small replies go out while big downloads are stalled on slow readers.
+    """
+    def setUp(self):
+        self.big = b"big download " * 400000
+        self.small = random_bytes(100)
+        with open(WWWROOT + "/big.bin", "wb") as f:
+            f.write(self.big)
+        with open(WWWROOT + "/small.bin", "wb") as f:
+            f.write(self.small)
+
+    def tearDown(self):
+        os.unlink(WWWROOT + "/big.bin")
+        os.unlink(WWWROOT + "/small.bin")
+
+    def test_small_while_big(self):
+        slow = []
+        for _ in range(4):
+            c = Conn()
+            c.s.send(b"GET /big.bin HTTP/1.0\r\n\r\n")
+            slow.append(c)
+        for _ in range(5):
+            status, hdrs, body = parse(self.get("/small.bin"))
+            self.assertContains(status, "200 OK")
+            self.assertEqual(body, self.small)
+        for c in slow:
+            resp = b""
+            while True:
+                signal.alarm(2) # don't wait forever
+                r = c.s.recv(1 << 20)
+                signal.alarm(0)
+                if r == b"":
+                    break
+                resp += r
+            c.close()
+            self.assertEqual(parse(resp)[2], self.big)
+
 def make_large_file(fn, boundary, data):
     with open(fn, 'wb') as f:
         pos = boundary - (len(data) // 2)
@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+# This is run by the "run-tests" script.
+import unittest
+import os
+import time
+from test import WWWROOT, TestHelper, parse, random_bytes
+
+# Without inotify, files changed within the last second don't get cached,
+# and cached ones are checked against the file at most once a second.
+SETTLE = 1.1
+
+class TestCache(TestHelper):
+    """Assumes the server has --cache-size and --fd-cache."""
+    @classmethod
+    def setUpClass(cls):
+        cls.url = "/cached.txt"
+        cls.fn = WWWROOT + cls.url
+        cls.data = random_bytes(2345)
+        with open(cls.fn, "wb") as f:
+            f.write(cls.data)
+        # Too big for memory, so it's kept open instead.
+        cls.big_url = "/cached.bin"
+        cls.big_fn = WWWROOT + cls.big_url
+        cls.big_data = random_bytes(200000)
+        with open(cls.big_fn, "wb") as f:
+            f.write(cls.big_data)
+        time.sleep(SETTLE)
+
+    @classmethod
+    def tearDownClass(cls):
+        os.unlink(cls.fn)
+        os.unlink(cls.big_fn)
+
+    def test_cached_get(self):
+        for _ in range(3):
+            resp = self.get(self.url)
+            status, hdrs, body = parse(resp)
+            self.assertContains(status, "200 OK")
+            self.assertEqual(hdrs["Accept-Ranges"], "bytes")
+            self.assertEqual(hdrs["Content-Length"], str(len(self.data)))
+            self.assertEqual(hdrs["Content-Type"], "text/plain")
+            self.assertEqual(body, self.data)
+
+    def test_cached_big_get(self):
+        for _ in range(3):
+            resp = self.get(self.big_url)
+            status, hdrs, body = parse(resp)
+            self.assertContains(status, "200 OK")
+            self.assertEqual(hdrs["Content-Length"], str(len(self.big_data)))
+            self.assertEqual(hdrs["Content-Type"], "application/octet-stream")
+            self.assertEqual(body, self.big_data)
+
+    def test_cached_big_range(self):
+        self.get(self.big_url)
+        resp = self.get(self.big_url, req_hdrs={"Range": "bytes=-1000"})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "206 Partial Content")
+        self.assertEqual(body, self.big_data[-1000:])
+
+    def test_cached_head(self):
+        self.get(self.url)
+        resp = self.get(self.url, method="HEAD")
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "200 OK")
+        self.assertEqual(hdrs["Content-Length"], str(len(self.data)))
+        self.assertEqual(body, b"")
+
+    def test_cached_range(self):
+        self.get(self.url)
+        resp = self.get(self.url, req_hdrs={"Range": "bytes=100-199"})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "206 Partial Content")
+        self.assertEqual(hdrs["Content-Range"], "bytes 100-199/2345")
+        self.assertEqual(body, self.data[100:200])
+
+    def test_cached_multiple_ranges(self):
+        for url, data in [(self.url, self.data),
+                          (self.big_url, self.big_data)]:
+            self.get(url)
+            resp = self.get(url, req_hdrs={"Range": "bytes=0-9,-10"})
+            status, hdrs, body = parse(resp)
+            self.assertContains(status, "206 Partial Content")
+            self.assertContains(hdrs["Content-Type"], "multipart/byteranges")
+            self.assertContains(body, "bytes 0-9/", "bytes %d-%d/" % (
+                len(data)-10, len(data)-1))
+            self.assertTrue(data[:10] in body)
+            self.assertTrue(data[-10:] in body)
+
+    def test_cached_not_modified(self):
+        resp = self.get(self.url)
+        status, hdrs, body = parse(resp)
+        resp = self.get(self.url,
+            req_hdrs={"If-Modified-Since": hdrs["Last-Modified"]})
+        status, hdrs, body = parse(resp)
+        self.assertContains(status, "304 Not Modified")
+
+class TestCacheInvalidation(TestHelper):
+    def test_cache_invalidation(self):
+        url = "/changing.txt"
+        fn = WWWROOT + url
+        with open(fn, "wb") as f:
+            f.write(b"old")
+        time.sleep(SETTLE)
+        self.assertEqual(parse(self.get(url))[2], b"old")
+
+        # Same size, and put the mtime back: only the ctime gives it away.
+        st = os.stat(fn)
+        with open(fn, "wb") as f:
+            f.write(b"new")
+        os.utime(fn, ns=(st.st_atime_ns, st.st_mtime_ns))
+        time.sleep(SETTLE)
+        self.assertEqual(parse(self.get(url))[2], b"new")
+
+        os.unlink(fn)
+        time.sleep(SETTLE)
+        status, hdrs, body = parse(self.get(url))
+        self.assertContains(status, "404 Not Found")
+
+    def test_cache_rename(self):
+        url = "/renamed/big.bin"
+        os.mkdir(WWWROOT + "/renamed")
+        fn = WWWROOT + url
+        with open(fn, "wb") as f:
+            f.write(random_bytes(100000))
+        time.sleep(SETTLE)
+        self.get(url)
+
+        # Replace it the way most deployments do.
+        data = random_bytes(100000)
+        with open(fn + ".tmp", "wb") as f:
+            f.write(data)
+        os.rename(fn + ".tmp", fn)
+        time.sleep(SETTLE)
+        self.assertEqual(parse(self.get(url))[2], data)
+
+        # Move the directory out from under it.
+        os.rename(WWWROOT + "/renamed", WWWROOT + "/moved")
+        time.sleep(SETTLE)
+        status, hdrs, body = parse(self.get(url))
+        self.assertContains(status, "404 Not Found")
+        os.unlink(WWWROOT + "/moved/big.bin")
+        os.rmdir(WWWROOT + "/moved")
+
+    def test_cache_symlink_swap(self):
+        # The usual atomic deploy: point a symlink at the new release.
+        url = "/current/page.txt"
+        for release in ["v1", "v2"]:
+            os.mkdir(WWWROOT + "/" + release)
+            with open(WWWROOT + "/" + release + "/page.txt", "wb") as f:
+                f.write(release.encode())
+        os.symlink("v1", WWWROOT + "/current")
+        time.sleep(SETTLE)
+        self.assertEqual(parse(self.get(url))[2], b"v1")
+        self.assertEqual(parse(self.get(url))[2], b"v1")
+
+        os.symlink("v2", WWWROOT + "/current.tmp")
+        os.rename(WWWROOT + "/current.tmp", WWWROOT + "/current")
+        time.sleep(SETTLE)
+        self.assertEqual(parse(self.get(url))[2], b"v2")
+        os.unlink(WWWROOT + "/current")
+        for release in ["v1", "v2"]:
+            os.unlink(WWWROOT + "/" + release + "/page.txt")
+            os.rmdir(WWWROOT + "/" + release)
+
+    def test_cache_file_links(self):
+        # Rewriting the target changes nothing in the directories on the
+        # way to the link, so inotify there can't be relied on.
+        os.mkdir(WWWROOT + "/target")
+        fn = WWWROOT + "/target/real.txt"
+        with open(fn, "wb") as f:
+            f.write(b"v1")
+        os.symlink("target/real.txt", WWWROOT + "/symlink.txt")
+        os.link(fn, WWWROOT + "/hardlink.txt")
+        time.sleep(SETTLE)
+        for url in ["/symlink.txt", "/hardlink.txt"]:
+            self.assertEqual(parse(self.get(url))[2], b"v1")
+            self.assertEqual(parse(self.get(url))[2], b"v1")
+
+        with open(fn, "wb") as f:
+            f.write(b"v2, longer")
+        time.sleep(SETTLE)
+        for url in ["/symlink.txt", "/hardlink.txt"]:
+            self.assertEqual(parse(self.get(url))[2], b"v2, longer", msg=url)
+        os.unlink(WWWROOT + "/symlink.txt")
+        os.unlink(WWWROOT + "/hardlink.txt")
+        os.unlink(fn)
+        os.rmdir(WWWROOT + "/target")
+
+if __name__ == '__main__':
+    unittest.main()
+
+# vim:set ts=4 sw=4 et:
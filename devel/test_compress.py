@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+# This is run by the "run-tests" script.
+import unittest
+import gzip
+import os
+import time
+from test import WWWROOT, TestHelper, parse, random_bytes
+
+class TestCompress(TestHelper):
+    """Assumes the server has --cache-size and --compress, with zlib."""
+    def setUp(self):
+        self.files = []
+
+    def tearDown(self):
+        for fn in self.files:
+            os.unlink(fn)
+
+    def write(self, url, data):
+        fn = WWWROOT + url
+        with open(fn, "wb") as f:
+            f.write(data)
+        if fn not in self.files:
+            self.files.append(fn)
+
+    def get_gzip(self, url, **kwargs):
+        hdrs = {"Accept-Encoding": "gzip"}
+        hdrs.update(kwargs)
+        status, hdrs, body = parse(self.get(url, req_hdrs=hdrs))
+        self.assertEqual(hdrs.get("Vary"), "Accept-Encoding")
+        return status, hdrs, body
+
+    def wait_for_gzip(self, url):
+        """The first requests go out as they are, while the compressed copy
+        is being made."""
+        for _ in range(100):
+            status, hdrs, body = self.get_gzip(url)
+            if "Content-Encoding" in hdrs:
+                break
+            time.sleep(0.02)
+        self.assertEqual(hdrs.get("Content-Encoding"), "gzip")
+        return status, hdrs, body
+
+    def test_text(self):
+        data = b"function f(x) { return x + 1; }\n" * 100
+        self.write("/script.js", data)
+        status, hdrs, body = self.get_gzip("/script.js")
+        self.assertContains(status, "200 OK")
+        self.assertFalse("Content-Encoding" in hdrs)
+        self.assertEqual(body, data)
+
+        status, hdrs, body = self.wait_for_gzip("/script.js")
+        self.assertContains(status, "200 OK")
+        self.assertEqual(hdrs["Content-Type"], "text/javascript")
+        self.assertEqual(hdrs["Content-Length"], str(len(body)))
+        self.assertLess(len(body), len(data))
+        self.assertEqual(gzip.decompress(body), data)
+
+        # It has its own ETag.
+        etag = hdrs["ETag"]
+        status, hdrs, body = self.get_gzip("/script.js",
+            **{"If-None-Match": etag})
+        self.assertContains(status, "304 Not Modified")
+
+        # Not for clients that don't take it.
+        status, hdrs, body = parse(self.get("/script.js",
+            req_hdrs={"If-None-Match": etag}))
+        self.assertFalse("Content-Encoding" in hdrs)
+        self.assertNotEqual(hdrs["ETag"], etag)
+        self.assertEqual(body, data)
+
+    def test_changed(self):
+        self.write("/changed.css", b"p { margin: 0 }\n" * 100)
+        self.wait_for_gzip("/changed.css")
+        data = b"p { padding: 0 }\n" * 200
+        self.write("/changed.css", data)
+        time.sleep(0.1) # for inotify
+        status, hdrs, body = self.get_gzip("/changed.css")
+        if "Content-Encoding" in hdrs:
+            body = gzip.decompress(body)
+        self.assertEqual(body, data)
+        status, hdrs, body = self.wait_for_gzip("/changed.css")
+        self.assertEqual(gzip.decompress(body), data)
+
+    def test_rewritten_same_second(self):
+        # Same size and same mtime: only the timing tells them apart.
+        while time.time() % 1 > 0.3:
+            time.sleep(0.05)
+        self.write("/rewritten.css", b"p { margin: 0 }\n" * 100)
+        self.get_gzip("/rewritten.css")
+        time.sleep(0.1) # long enough to compress the first one
+        data = b"p { margin: 1 }\n" * 100
+        self.write("/rewritten.css", data)
+        time.sleep(1.1)
+        status, hdrs, body = self.wait_for_gzip("/rewritten.css")
+        self.assertEqual(gzip.decompress(body), data)
+
+    def test_binary(self):
+        data = random_bytes(5000)
+        self.write("/random.bin", data)
+        for _ in range(5):
+            status, hdrs, body = self.get_gzip("/random.bin")
+            self.assertFalse("Content-Encoding" in hdrs)
+            self.assertEqual(body, data)
+            time.sleep(0.02)
+
+    def test_incompressible(self):
+        data = random_bytes(5000).hex().encode()
+        self.write("/hex.txt", data)
+        for _ in range(5):
+            status, hdrs, body = self.get_gzip("/hex.txt")
+            if "Content-Encoding" in hdrs:
+                # hex does compress by about half
+                self.assertEqual(gzip.decompress(body), data)
+            time.sleep(0.02)
+        data = random_bytes(5000)
+        self.write("/random.txt", data)
+        for _ in range(5):
+            status, hdrs, body = self.get_gzip("/random.txt")
+            self.assertFalse("Content-Encoding" in hdrs)
+            self.assertEqual(body, data)
+            time.sleep(0.02)
+
+    def test_small(self):
+        self.write("/small.txt", b"hello\n")
+        for _ in range(5):
+            status, hdrs, body = self.get_gzip("/small.txt")
+            self.assertFalse("Content-Encoding" in hdrs)
+            time.sleep(0.02)
+
+    def test_range(self):
+        data = b"body { color: red }\n" * 100
+        self.write("/range.css", data)
+        status, hdrs, whole = self.wait_for_gzip("/range.css")
+        status, hdrs, body = self.get_gzip("/range.css", Range="bytes=5-14")
+        self.assertContains(status, "206 Partial Content")
+        self.assertEqual(hdrs["Content-Encoding"], "gzip")
+        self.assertEqual(hdrs["Content-Range"],
+                         "bytes 5-14/{}".format(len(whole)))
+        self.assertEqual(body, whole[5:15])
+
+    def test_listing(self):
+        os.mkdir(WWWROOT + "/listed")
+        for i in range(20):
+            self.write("/listed/file{}.txt".format(i), b"x")
+        status, hdrs, body = self.wait_for_gzip("/listed/")
+        self.assertEqual(hdrs["Content-Type"], "text/html; charset=UTF-8")
+        listing = gzip.decompress(body)
+        self.assertContains(listing, "file0.txt", "file19.txt")
+
+        # A new file means a new listing.
+        self.write("/listed/extra.txt", b"x")
+        status, hdrs, body = self.get_gzip("/listed/")
+        if "Content-Encoding" in hdrs:
+            body = gzip.decompress(body)
+        self.assertContains(body, "extra.txt")
+        for fn in self.files:
+            os.unlink(fn)
+        self.files = []
+        os.rmdir(WWWROOT + "/listed")
+
+if __name__ == '__main__':
+    unittest.main()
+
+# vim:set ts=4 sw=4 et:
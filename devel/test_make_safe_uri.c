@@ -6,7 +6,8 @@ static void
 test(const char *input, const char *expected)
 {
     char *tmp = xstrdup(input);
-    char *out = make_safe_url(tmp);
+    char *buf = xmalloc(strlen(input) + 1);
+    char *out = make_safe_url(tmp, buf);
 
     if (expected == NULL) {
         if (out == NULL)
@@ -23,6 +24,7 @@ test(const char *input, const char *expected)
     else
         printf("FAIL: \"%s\" => \"%s\", expecting \"%s\"\n",
             input, out, expected);
+    free(buf);
     free(tmp);
 }
 
@@ -49,6 +51,22 @@ static char const *tests[] = {
     "/a/b/../../../c", NULL,
     /* don't forget consolidate_slashes */
     "//a///b////c/////", "/a/b/c/",
+    /* query strings are cut off before decoding */
+    "/abc?def", "/abc",
+    "/abc/../def?/../..", "/def",
+    "/what%3f.jpg?x", "/what?.jpg",
+    /* %XX escapes are decoded before the path is resolved */
+    "/%61%62%63", "/abc",
+    "/%4A%4b", "/JK",
+    "/%2e%2e/", NULL,
+    "/abc/%2E%2e/def", "/def",
+    "/abc%2f..%2fdef", "/def",
+    "%2fabc", "/abc",
+    "/abc%00/../..", "/abc",
+    /* and invalid ones are left alone */
+    "/%", "/%",
+    "/%4", "/%4",
+    "/%4g%g4%%41", "/%4g%g4%A",
     NULL
 };
 
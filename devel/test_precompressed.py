@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+# This is run by the "run-tests" script.
+import unittest
+import os
+from test import WWWROOT, TestHelper, parse, random_bytes
+
+class TestPrecompressed(TestHelper):
+    """Assumes the server has --precompressed."""
+    def setUp(self):
+        self.url = "/style.css"
+        self.fn = WWWROOT + self.url
+        self.files = {}
+        self.write("", b"body { color: red }\n" * 100, 1000)
+
+    def tearDown(self):
+        for fn in self.files:
+            os.unlink(fn)
+
+    def write(self, ext, data, mtime):
+        with open(self.fn + ext, "wb") as f:
+            f.write(data)
+        os.utime(self.fn + ext, (mtime, mtime))
+        self.files[self.fn + ext] = data
+
+    def get_encoded(self, accept, **kwargs):
+        hdrs = {"Accept-Encoding": accept}
+        hdrs.update(kwargs)
+        status, hdrs, body = parse(self.get(self.url, req_hdrs=hdrs))
+        self.assertEqual(hdrs.get("Vary"), "Accept-Encoding")
+        return status, hdrs, body
+
+    def test_no_sidecar(self):
+        status, hdrs, body = self.get_encoded("gzip, br")
+        self.assertContains(status, "200 OK")
+        self.assertFalse("Content-Encoding" in hdrs)
+        self.assertEqual(body, self.files[self.fn])
+
+    def test_gzip(self):
+        self.write(".gz", random_bytes(100), 2000)
+        status, hdrs, body = self.get_encoded("gzip, deflate")
+        self.assertContains(status, "200 OK")
+        self.assertEqual(hdrs["Content-Encoding"], "gzip")
+        self.assertEqual(hdrs["Content-Type"], "text/css")
+        self.assertEqual(hdrs["Content-Length"], "100")
+        self.assertEqual(body, self.files[self.fn + ".gz"])
+
+    def test_preference(self):
+        self.write(".gz", random_bytes(100), 2000)
+        self.write(".zst", random_bytes(90), 2000)
+        self.write(".br", random_bytes(80), 2000)
+        for accept, encoding in [
+                ("gzip, deflate, br, zstd", "br"),
+                ("gzip, zstd", "zstd"),
+                ("gzip, br;q=0, zstd;q=0.000", "gzip"),
+                ("*", "br"),
+                ("*, br;q=0", "zstd"),
+                ("x-gzip", "gzip"),
+                ("gzip;q=", "gzip"),
+                ]:
+            status, hdrs, body = self.get_encoded(accept)
+            self.assertEqual(hdrs.get("Content-Encoding"), encoding,
+                msg="Accept-Encoding: " + accept)
+            self.assertEqual(body, self.files[self.fn + ".gz"
+                if encoding == "gzip" else self.fn + ".zst"
+                if encoding == "zstd" else self.fn + ".br"])
+
+    def test_refused(self):
+        self.write(".gz", random_bytes(100), 2000)
+        for accept in ["identity", "gzip;q=0", "*;q=0", "deflate",
+                       "gzip;q=0."]:
+            status, hdrs, body = self.get_encoded(accept)
+            self.assertFalse("Content-Encoding" in hdrs)
+            self.assertEqual(body, self.files[self.fn])
+
+    def test_stale_sidecar(self):
+        self.write(".gz", random_bytes(100), 500)
+        status, hdrs, body = self.get_encoded("gzip")
+        self.assertFalse("Content-Encoding" in hdrs)
+        self.assertEqual(body, self.files[self.fn])
+
+    def test_range(self):
+        self.write(".gz", random_bytes(100), 2000)
+        status, hdrs, body = self.get_encoded("gzip", Range="bytes=10-19")
+        self.assertContains(status, "206 Partial Content")
+        self.assertEqual(hdrs["Content-Encoding"], "gzip")
+        self.assertEqual(hdrs["Content-Range"], "bytes 10-19/100")
+        self.assertEqual(body, self.files[self.fn + ".gz"][10:20])
+
+    def test_if_modified_since(self):
+        self.write(".gz", random_bytes(100), 2000)
+        status, hdrs, body = self.get_encoded("gzip")
+        lastmod = hdrs["Last-Modified"]
+        status, hdrs, body = self.get_encoded("gzip",
+            **{"If-Modified-Since": lastmod})
+        self.assertContains(status, "304 Not Modified")
+
+    def test_if_none_match(self):
+        self.write(".gz", random_bytes(100), 2000)
+        status, hdrs, body = self.get_encoded("gzip")
+        etag = hdrs["ETag"]
+        status, hdrs, body = self.get_encoded("gzip",
+            **{"If-None-Match": etag})
+        self.assertContains(status, "304 Not Modified")
+        # The sidecar is a different representation from the original, so a
+        # client without gzip doesn't have it.
+        status, hdrs, body = self.get_encoded("br",
+            **{"If-None-Match": etag})
+        self.assertContains(status, "200 OK")
+        self.assertNotEqual(hdrs["ETag"], etag)
+
+if __name__ == '__main__':
+    unittest.main()
+
+# vim:set ts=4 sw=4 et:
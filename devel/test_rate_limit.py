@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+# This is run by the "run-tests" script.
+import unittest
+import os
+import threading
+import time
+from test import WWWROOT, TestHelper, parse, random_bytes
+
+class TestRateLimit(TestHelper):
+    """Assumes the server has --rate-limit 100000, --rate-limit-path /fast/ 0
+    and --client-rate-limit 300000."""
+    @classmethod
+    def setUpClass(cls):
+        os.mkdir(WWWROOT + "/fast")
+        cls.data = random_bytes(1000) * 250
+        for url in ["/slow.bin", "/fast/a.bin", "/fast/b.bin"]:
+            with open(WWWROOT + url, "wb") as f:
+                f.write(cls.data)
+
+    @classmethod
+    def tearDownClass(cls):
+        for url in ["/slow.bin", "/fast/a.bin", "/fast/b.bin"]:
+            os.unlink(WWWROOT + url)
+        os.rmdir(WWWROOT + "/fast")
+
+    def refill(self):
+        # Let the client's bucket fill up after the tests before.
+        time.sleep(1.0)
+
+    def timed_get(self, url, **kwargs):
+        t0 = time.time()
+        status, hdrs, body = parse(self.get(url, **kwargs))
+        return status, hdrs, body, time.time() - t0
+
+    def test_limited(self):
+        # A second's worth goes straight out, then 100000 bytes a second.
+        status, hdrs, body, secs = self.timed_get("/slow.bin")
+        self.assertContains(status, "200 OK")
+        self.assertEqual(body, self.data)
+        self.assertGreater(secs, 1.0)
+
+    def test_small_files(self):
+        # Bodies small enough to go out with the header count too.
+        small = self.data[:16000]
+        with open(WWWROOT + "/fast/small.bin", "wb") as f:
+            f.write(small)
+        t0 = time.time()
+        for _ in range(40):
+            status, hdrs, body = parse(self.get("/fast/small.bin"))
+            self.assertEqual(body, small)
+        os.unlink(WWWROOT + "/fast/small.bin")
+        self.assertGreater(time.time() - t0, 0.8)
+
+    def test_unlimited_path(self):
+        self.refill()
+        status, hdrs, body, secs = self.timed_get("/fast/a.bin")
+        self.assertEqual(body, self.data)
+        self.assertLess(secs, 0.5)
+
+    def test_encoded_path(self):
+        # The prefix is matched after decoding, however it's spelled.
+        for url in ["/%66ast/a.bin", "//fast/a.bin", "/./fast/a.bin"]:
+            self.refill()
+            status, hdrs, body, secs = self.timed_get(url)
+            self.assertEqual(body, self.data, msg=url)
+            self.assertLess(secs, 0.5, msg=url)
+
+    def test_head(self):
+        status, hdrs, body, secs = self.timed_get("/slow.bin", method="HEAD")
+        self.assertContains(status, "200 OK")
+        self.assertEqual(hdrs["Content-Length"], str(len(self.data)))
+        self.assertLess(secs, 0.5)
+
+    def test_range(self):
+        status, hdrs, body, secs = self.timed_get("/slow.bin",
+            req_hdrs={"Range": "bytes=1000-50999"})
+        self.assertContains(status, "206 Partial Content")
+        self.assertEqual(body, self.data[1000:51000])
+        self.assertLess(secs, 0.5)
+
+    def test_client(self):
+        # Two at once share the client's 300000 bytes a second.
+        results = {}
+        def fetch(url):
+            results[url] = self.timed_get(url)
+        t0 = time.time()
+        threads = [threading.Thread(target=fetch, args=(url,))
+                   for url in ["/fast/a.bin", "/fast/b.bin"]]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        for url in ["/fast/a.bin", "/fast/b.bin"]:
+            self.assertEqual(results[url][2], self.data)
+        self.assertGreater(time.time() - t0, 0.5)
+
+if __name__ == '__main__':
+    unittest.main()
+
+# vim:set ts=4 sw=4 et:
@@ -17,6 +17,29 @@ class TestTimeout(unittest.TestCase):
         s.close()
         self.assertEqual(ret, b'')
 
+    def test_slow_header(self):
+        port = 12346
+        s = socket.socket()
+        s.connect(("0.0.0.0", port))
+        s.settimeout(0.25)
+        # Assumes the server has a header timeout of 1 second.  Trickling in
+        # the request a byte at a time shouldn't keep the connection open.
+        signal.alarm(3)
+        ret = None
+        for c in b"GET / HTTP/1.1\r\nUser-Agent: slowloris\r\n":
+            try:
+                s.send(bytes([c]))
+                ret = s.recv(1024)
+                break
+            except socket.timeout:
+                continue
+            except ConnectionResetError:
+                ret = b''
+                break
+        signal.alarm(0)
+        s.close()
+        self.assertEqual(ret, b'')
+
 if __name__ == '__main__':
     unittest.main()
 